@@ -0,0 +1,261 @@
+// logknife_bench: microbenchmarks for the hot kernels, with an optional
+// regression check against a stored baseline.
+//
+//   logknife_bench                          print ns/op per kernel
+//   logknife_bench --write-baseline FILE    ... and store them
+//   logknife_bench --baseline FILE          fail if a kernel got >10% slower
+//
+// The tool source is compiled in directly (without its main) so the kernels
+// are benchmarked exactly as the CLI builds them, static functions included.
+// Inputs come from the same fixed-seed generator as `logknife bench`.
+
+#define LOGKNIFE_NO_MAIN
+#include "../src/logknife.c"
+
+#define KERNEL_LINES 100000
+#define KERNEL_RUNS 7
+#define TAIL_LINES 1000
+#define KERNEL_RETRIES 3
+
+typedef struct {
+  const char *name;
+  double ns_per_op;
+} kernel_result_t;
+
+static FILE *g_report;
+
+// best of KERNEL_RUNS, in ns per op
+static double kernel_best(int64_t (*fn)(void *), void *arg, long ops) {
+  int64_t best = -1;
+  for (int k = 0; k < KERNEL_RUNS; k++) {
+    int64_t dt = fn(arg);
+    if (best < 0 || dt < best) best = dt;
+  }
+  return (double)best / (double)ops;
+}
+
+typedef struct {
+  const bench_corpus_t *c;
+  const lk_re_t *re;
+  const char *pat;
+  FILE *sink;
+  FILE *tmp;
+  pipeline_t *p;
+  volatile uint64_t check;
+} kernel_arg_t;
+
+static int64_t k_matchre_builtin(void *arg) {
+  kernel_arg_t *a = (kernel_arg_t *)arg;
+  uint64_t n;
+  int64_t dt = bench_filter_builtin(a->c, a->pat, &n);
+  a->check = n;
+  return dt;
+}
+
+#if defined(LOGKNIFE_USE_PCRE2)
+static int64_t k_re_match(void *arg) {
+  kernel_arg_t *a = (kernel_arg_t *)arg;
+  uint64_t n;
+  int64_t dt = bench_filter_re(a->c, a->re, &n);
+  a->check = n;
+  return dt;
+}
+#endif
+
+static int64_t k_highlight(void *arg) {
+  kernel_arg_t *a = (kernel_arg_t *)arg;
+  uint64_t n;
+  return bench_render(a->c, a->sink, false, &n);
+}
+
+static int64_t k_json(void *arg) {
+  kernel_arg_t *a = (kernel_arg_t *)arg;
+  uint64_t n;
+  return bench_render(a->c, a->sink, true, &n);
+}
+
+static int64_t k_tail(void *arg) {
+  kernel_arg_t *a = (kernel_arg_t *)arg;
+  reader_t r;
+  if (!reader_init(&r, a->tmp)) return 0;
+  int64_t t0 = now_ns();
+  tail_last_lines(&r, TAIL_LINES, a->p);
+  fflush(stdout);
+  int64_t dt = now_ns() - t0;
+  reader_free(&r);
+  return dt;
+}
+
+static bool load_baseline(const char *path, kernel_result_t **out, size_t *count) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  char line[256];
+  *out = NULL;
+  *count = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#' || line[0] == '\n') continue;
+    char name[128];
+    double ns;
+    if (sscanf(line, "%127s %lf", name, &ns) != 2) continue;
+    kernel_result_t *n = (kernel_result_t *)realloc(*out, (*count + 1) * sizeof(kernel_result_t));
+    if (!n) break;
+    *out = n;
+    n[*count].name = strndup_s(name, strlen(name));
+    n[*count].ns_per_op = ns;
+    (*count)++;
+  }
+  fclose(fp);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const char *baseline = NULL;
+  const char *write_to = NULL;
+  double tolerance = 0.10;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baseline = argv[++i];
+    } else if (strcmp(argv[i], "--write-baseline") == 0 && i + 1 < argc) {
+      write_to = argv[++i];
+    } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+      tolerance = parse_fraction(argv[++i]);
+      if (tolerance <= 0.0) {
+        fprintf(stderr, "Invalid --tolerance (use 10%% or 0.1)\n");
+        return 2;
+      }
+    } else {
+      fprintf(stderr, "Usage: logknife_bench [--baseline FILE [--tolerance 10%%]] [--write-baseline FILE]\n");
+      return 2;
+    }
+  }
+
+  (void)cmd_bench;  // CLI entry points, not used here
+  (void)cmd_serve;
+  (void)cmd_subscribe;
+  (void)cmd_ring;
+  enable_ansi_if_windows();
+
+  // kernels print to stdout; the report keeps the real one
+#ifdef _WIN32
+  g_report = _fdopen(_dup(_fileno(stdout)), "w");
+#else
+  g_report = fdopen(dup(fileno(stdout)), "w");
+#endif
+  if (!g_report || !freopen(NULL_DEVICE, "w", stdout)) {
+    fprintf(stderr, "Failed to redirect stdout\n");
+    return 1;
+  }
+
+  bench_opts_t b;
+  memset(&b, 0, sizeof(b));
+  b.lines = KERNEL_LINES;
+  b.line_len = 160;
+  b.match_rate = 0.1;
+  b.seed = 1;
+  b.pattern = "ERROR";
+
+  bench_corpus_t plain, json;
+  if (!bench_generate(&plain, BENCH_PLAIN, &b) || !bench_generate(&json, BENCH_JSON, &b)) {
+    fprintf(stderr, "OOM\n");
+    return 1;
+  }
+  lk_re_t re;
+  memset(&re, 0, sizeof(re));
+  lk_re_compile(&re, b.pattern);
+  FILE *sink = fopen(NULL_DEVICE, "wb");
+  FILE *tmp = tmpfile();
+  if (!sink || !tmp || fwrite(plain.text, 1, plain.len, tmp) != plain.len || fflush(tmp) != 0) {
+    fprintf(stderr, "Failed to set up sink/temp file\n");
+    return 1;
+  }
+  static char sinkbuf[1 << 16];
+  setvbuf(sink, sinkbuf, _IOFBF, sizeof(sinkbuf));
+
+  opts_t o;
+  char *targv[] = {"logknife", "scan", "-", NULL};
+  parse_args(3, targv, &o);
+  pipeline_t p;
+  if (!pipeline_init(&p, &o)) return 1;
+
+  kernel_arg_t a;
+  memset(&a, 0, sizeof(a));
+  a.re = &re;
+  a.pat = b.pattern;
+  a.sink = sink;
+  a.tmp = tmp;
+  a.p = &p;
+
+  struct {
+    const char *name;
+    int64_t (*fn)(void *);
+    const bench_corpus_t *c;
+    long ops;
+  } kernels[] = {
+    {"matchre_builtin", k_matchre_builtin, &plain, KERNEL_LINES},
+#if defined(LOGKNIFE_USE_PCRE2)
+    {"re_match_pcre2", k_re_match, &plain, KERNEL_LINES},
+#endif
+    {"print_highlighted_plain", k_highlight, &plain, KERNEL_LINES},
+    {"print_json_colorized", k_json, &json, KERNEL_LINES},
+    {"tail_last_lines", k_tail, &plain, TAIL_LINES},
+  };
+  size_t nres = sizeof(kernels) / sizeof(kernels[0]);
+  kernel_result_t results[sizeof(kernels) / sizeof(kernels[0])];
+
+  kernel_result_t *base = NULL;
+  size_t nbase = 0;
+  if (baseline && !load_baseline(baseline, &base, &nbase)) return 2;
+
+  int rc = 0;
+  fprintf(g_report, "%-26s %10s %10s %8s\n", "kernel", "ns/op", "baseline", "change");
+  for (size_t i = 0; i < nres; i++) {
+    const kernel_result_t *k = NULL;
+    for (size_t j = 0; j < nbase; j++) {
+      if (strcmp(base[j].name, kernels[i].name) == 0) k = &base[j];
+    }
+    a.c = kernels[i].c;
+    results[i].name = kernels[i].name;
+    results[i].ns_per_op = kernel_best(kernels[i].fn, &a, kernels[i].ops);
+    // a slow result is re-measured before it counts, to ride out noisy neighbours
+    for (int retry = 0; k && retry < KERNEL_RETRIES && results[i].ns_per_op > k->ns_per_op * (1.0 + tolerance); retry++) {
+      double again = kernel_best(kernels[i].fn, &a, kernels[i].ops);
+      if (again < results[i].ns_per_op) results[i].ns_per_op = again;
+    }
+    if (!k) {
+      fprintf(g_report, "%-26s %10.1f %10s\n", results[i].name, results[i].ns_per_op, "-");
+      continue;
+    }
+    double change = results[i].ns_per_op / k->ns_per_op - 1.0;
+    bool slow = change > tolerance;
+    if (slow) rc = 1;
+    fprintf(g_report, "%-26s %10.1f %10.1f %+7.1f%%%s\n", results[i].name, results[i].ns_per_op,
+            k->ns_per_op, change * 100.0, slow ? "  REGRESSION" : "");
+  }
+
+  if (write_to) {
+    FILE *out = fopen(write_to, "w");
+    if (!out) {
+      fprintf(stderr, "Failed to write %s: %s\n", write_to, strerror(errno));
+      rc = 2;
+    } else {
+      fprintf(out, "# logknife_bench baseline (ns/op). Machine specific: regenerate with\n"
+                   "#   logknife_bench --write-baseline <file>\n");
+      for (size_t i = 0; i < nres; i++) fprintf(out, "%s %.1f\n", results[i].name, results[i].ns_per_op);
+      fclose(out);
+    }
+  }
+  fflush(g_report);
+
+  for (size_t j = 0; j < nbase; j++) free((void *)base[j].name);
+  free(base);
+  pipeline_free(&p);
+  fclose(tmp);
+  fclose(sink);
+  lk_re_free(&re);
+  bench_corpus_free(&plain);
+  bench_corpus_free(&json);
+  return rc;
+}
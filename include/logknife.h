@@ -0,0 +1,93 @@
+// liblogknife: in-process line filtering with logknife's rules.
+//
+// Compile include/exclude patterns once, then push raw bytes as they arrive.
+// Complete lines inside a pushed chunk are matched and handed to the callback
+// in place (no copy); only a line split across two pushes is assembled in a
+// buffer the caller provides. Nothing here allocates after lk_rules_compile.
+//
+//   lk_rules *rules = lk_rules_compile(inc, 1, NULL, 0, err, sizeof(err));
+//   char buf[64 * 1024];
+//   lk_stream s;
+//   lk_stream_init(&s, rules, buf, sizeof(buf), on_line, ctx);
+//   while ((n = read(fd, chunk, sizeof(chunk))) > 0) lk_stream_push(&s, chunk, n);
+//   lk_stream_finish(&s);
+//   lk_rules_free(rules);
+//
+// Compiled rules are read-only while matching and may be shared by streams on
+// different threads; a stream belongs to one thread.
+
+#ifndef LOGKNIFE_H
+#define LOGKNIFE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Only what is declared here is exported from a shared build. Programs that
+// use the Windows DLL define LOGKNIFE_DLL (the CMake target does).
+#if defined(_WIN32)
+#if defined(LOGKNIFE_BUILD_DLL)
+#define LK_API __declspec(dllexport)
+#elif defined(LOGKNIFE_DLL)
+#define LK_API __declspec(dllimport)
+#else
+#define LK_API
+#endif
+#elif defined(__GNUC__)
+#define LK_API __attribute__((visibility("default")))
+#else
+#define LK_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lk_rules lk_rules;
+
+// A line is kept when it matches any include (or there are none) and no
+// exclude. Patterns use PCRE2 when the library was built with it, else the
+// built-in subset (^ $ . *). Returns NULL on error, with a message in err.
+LK_API lk_rules *lk_rules_compile(const char *const *include, size_t include_count,
+                                  const char *const *exclude, size_t exclude_count,
+                                  char *err, size_t err_len);
+LK_API void lk_rules_free(lk_rules *rules);
+
+// 1 if the line is kept. line need not be NUL-terminated.
+LK_API int lk_rules_match(const lk_rules *rules, const char *line, size_t len);
+
+// lk_rules_match for callers that keep per-rule statistics: on_rule sees
+// every rule as it is evaluated, with 1 if it matched. Rules are numbered
+// includes first, then excludes. With all_includes set, every include is
+// evaluated instead of stopping at the first that matches.
+typedef void (*lk_rule_fn)(void *user, size_t rule, int matched);
+LK_API int lk_rules_match_each(const lk_rules *rules, const char *line, size_t len,
+                               int all_includes, lk_rule_fn on_rule, void *user);
+
+// line excludes the newline (and a trailing \r); it is only valid during the
+// call and is not NUL-terminated.
+typedef void (*lk_line_fn)(void *user, const char *line, size_t len);
+
+typedef struct {
+  const lk_rules *rules;   // NULL: every line is kept
+  lk_line_fn on_line;
+  void *user;
+  char *buf;               // caller's buffer for a line split across pushes
+  size_t cap;
+  size_t len;
+  int overflow;            // the pending line did not fit; it is cut at cap
+  uint64_t lines;          // lines seen
+  uint64_t kept;           // lines passed to on_line
+  uint64_t truncated;      // lines longer than cap that were cut
+} lk_stream;
+
+LK_API void lk_stream_init(lk_stream *s, const lk_rules *rules, char *buf, size_t cap,
+                           lk_line_fn on_line, void *user);
+LK_API void lk_stream_push(lk_stream *s, const char *data, size_t len);
+// Emit a final line that has no newline.
+LK_API void lk_stream_finish(lk_stream *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
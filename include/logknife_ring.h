@@ -0,0 +1,167 @@
+// logknife ring: printed lines published into a memory-mapped file.
+//
+// `logknife follow app.log --include ERROR --ring /dev/shm/errors.ring`
+// appends every line it would print to a single-producer, multi-consumer
+// ring in that file. Consumers map the file read-only and copy records
+// straight out of shared memory: no syscalls, no pipe. Nothing a consumer
+// does can slow the writer down; a consumer that falls a whole ring behind
+// is told how many records it lost and resumes at the oldest intact one.
+//
+//   int fd = open(path, O_RDONLY);
+//   struct stat st;
+//   fstat(fd, &st);
+//   void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+//   lk_ring_reader r;
+//   if (!lk_ring_attach(&r, map, st.st_size, 0)) ... not a ring
+//   char line[4096];
+//   size_t len;
+//   uint64_t lost;
+//   for (;;) {
+//     if (!lk_ring_next(&r, line, sizeof(line), &len, &lost)) { wait a little; continue; }
+//     if (lost) ... lost records before this one
+//     ... line[0 .. min(len, sizeof(line)))
+//   }
+//
+// Layout: an LK_RING_HEADER-byte header, then `capacity` bytes (a power of
+// two) of records. Positions are byte offsets that only grow; a position's
+// place in the data area is pos & (capacity - 1). A record is an
+// lk_ring_record followed by len bytes, padded to LK_RING_ALIGN. Records
+// never wrap: one that would not fit before the end is preceded by a
+// padding record covering the rest of the area.
+//
+// The writer claims space (reserve) before writing it and publishes it
+// (head) after, so a reader copies a record and then checks that reserve
+// has not reached it: a seqlock per record. Needs C11 atomics that are
+// lock-free for 64-bit values and POSIX (mmap, nanosleep); this header is
+// C only.
+
+#ifndef LOGKNIFE_RING_H
+#define LOGKNIFE_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define LK_RING_MAGIC 0x31474e49524b4c00ull  // "\0LKRING1" little-endian
+#define LK_RING_VERSION 1
+#define LK_RING_HEADER 4096
+#define LK_RING_ALIGN 16
+#define LK_RING_PAD 1u                      // record flag: skip to the end of the area
+#define LK_RING_ATTACH_WAIT_MS 100          // longest lk_ring_attach waits for a writer
+
+typedef struct {
+  uint64_t magic;               // written last, once the rest is valid
+  uint32_t version;
+  uint32_t header_size;         // LK_RING_HEADER
+  uint64_t capacity;            // bytes of record data, a power of two
+  _Atomic uint64_t head;        // end of the last published record
+  _Atomic uint64_t reserve;     // end of the record being written
+  _Atomic uint64_t tail;        // start of the oldest record not yet overwritten
+  _Atomic uint64_t seq;         // records published
+} lk_ring_header;
+
+typedef struct {
+  uint32_t len;                 // payload bytes (for padding: bytes to skip)
+  uint32_t flags;               // LK_RING_PAD
+  uint64_t seq;                 // 1, 2, 3, ... in publishing order; padding has the next one
+} lk_ring_record;
+
+// bytes a record with len payload bytes occupies
+#define LK_RING_SIZE(len) \
+  (((uint64_t)sizeof(lk_ring_record) + (len) + LK_RING_ALIGN - 1) & ~(uint64_t)(LK_RING_ALIGN - 1))
+
+typedef struct {
+  const unsigned char *data;    // record area
+  const lk_ring_header *h;
+  uint64_t capacity;
+  uint64_t pos;                 // next record
+  uint64_t next_seq;            // seq of the record at pos
+} lk_ring_reader;
+
+// Copies the next record into buf, up to cap bytes; *len is its full length
+// and *lost the number of records overwritten before this reader got to
+// them. Returns 0 if nothing new has been published.
+static inline int lk_ring_next(lk_ring_reader *r, char *buf, size_t cap, size_t *len, uint64_t *lost) {
+  const lk_ring_header *h = r->h;
+  for (;;) {
+    uint64_t head = atomic_load_explicit(&h->head, memory_order_acquire);
+    if (r->pos == head) return 0;
+    uint64_t off = r->pos & (r->capacity - 1);
+    uint64_t room = r->capacity - off - sizeof(lk_ring_record);
+    lk_ring_record rec;
+    memcpy(&rec, r->data + off, sizeof(rec));
+    size_t n = rec.len < cap ? rec.len : cap;
+    if (n > room) n = (size_t)room;  // a torn header; caught below
+    if (!(rec.flags & LK_RING_PAD)) memcpy(buf, r->data + off + sizeof(rec), n);
+
+    // the copy is only good if the writer has not started reusing its bytes
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t reserve = atomic_load_explicit(&h->reserve, memory_order_relaxed);
+    if (reserve - r->pos > r->capacity) {
+      r->pos = atomic_load_explicit(&h->tail, memory_order_acquire);
+      continue;
+    }
+    if (rec.len > room) {  // not written by logknife; skip everything there is
+      r->pos = head;
+      return 0;
+    }
+    r->pos += LK_RING_SIZE(rec.len);
+    if (rec.flags & LK_RING_PAD) continue;
+    *len = rec.len;
+    *lost = rec.seq - r->next_seq;
+    r->next_seq = rec.seq + 1;
+    return 1;
+  }
+}
+
+// 1 if map holds a ring. Reading starts with the next record published, or
+// with the oldest one still in the ring if from_start is set. May sleep up
+// to LK_RING_ATTACH_WAIT_MS while the writer overwrites the whole ring.
+static inline int lk_ring_attach(lk_ring_reader *r, const void *map, size_t map_len, int from_start) {
+  const lk_ring_header *h = (const lk_ring_header *)map;
+  if (map_len < LK_RING_HEADER || h->magic != LK_RING_MAGIC || h->version != LK_RING_VERSION) return 0;
+  uint64_t cap = h->capacity;
+  if (h->header_size != LK_RING_HEADER || cap < LK_RING_ALIGN * 2 || (cap & (cap - 1)) != 0 ||
+      map_len < LK_RING_HEADER + cap) {
+    return 0;
+  }
+  r->h = h;
+  r->data = (const unsigned char *)map + LK_RING_HEADER;
+  r->capacity = cap;
+  // start at the oldest record, whose seq (padding carries the next one's)
+  // makes every later loss count exact
+  for (int waited_ms = 0;;) {
+    r->pos = atomic_load_explicit(&h->tail, memory_order_acquire);
+    uint64_t head = atomic_load_explicit(&h->head, memory_order_acquire);
+    if (r->pos == head) {
+      // empty, or the writer is overwriting the whole ring with one record:
+      // wait for it, unless the writer died half way
+      r->next_seq = atomic_load_explicit(&h->seq, memory_order_relaxed) + 1;
+      if (head == 0 || waited_ms >= LK_RING_ATTACH_WAIT_MS) break;
+      struct timespec ts = {0, 1000000};
+      nanosleep(&ts, NULL);
+      waited_ms++;
+      continue;
+    }
+    lk_ring_record rec;
+    memcpy(&rec, r->data + (r->pos & (cap - 1)), sizeof(rec));
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&h->reserve, memory_order_relaxed) - r->pos <= cap) {
+      r->next_seq = rec.seq;
+      break;
+    }
+  }
+  if (!from_start) {
+    uint64_t head = atomic_load_explicit(&h->head, memory_order_acquire);
+    char none;
+    size_t len;
+    uint64_t lost;
+    while (r->pos < head && lk_ring_next(r, &none, 0, &len, &lost)) {
+    }
+  }
+  return 1;
+}
+
+#endif
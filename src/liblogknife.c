@@ -0,0 +1,302 @@
+// liblogknife: regex layer, rule sets and the push-bytes line splitter.
+// The CLI (src/logknife.c) is built on the same regex layer.
+
+#include "logknife.h"
+#include "lk_regex.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(LOGKNIFE_USE_PCRE2)
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#endif
+
+// -------------------------
+// Built-in minimal regex (K&R / Pike style)
+// Supports: ^ $ . *
+// Reference: The Practice of Programming (classic)
+// matchhere returns the end of the match (or NULL) so callers can extract spans.
+// Text is [text, end); it need not be NUL-terminated.
+// -------------------------
+
+static const char *matchhere(const char *re, const char *text, const char *end);
+
+static const char *matchstar(int c, const char *re, const char *text, const char *end) {
+  // leftmost-longest: consume as much as possible, then back off
+  const char *t = text;
+  while (t < end && (*t == c || c == '.')) t++;
+  for (;;) {
+    const char *e = matchhere(re, t, end);
+    if (e) return e;
+    if (t == text) return NULL;
+    t--;
+  }
+}
+
+static const char *matchhere(const char *re, const char *text, const char *end) {
+  if (re[0] == '\0') return text;
+  if (re[0] == '$' && re[1] == '\0') return text == end ? text : NULL;
+  if (re[1] == '*') return matchstar(re[0], re + 2, text, end);
+  if (text < end && (re[0] == '.' || re[0] == *text))
+    return matchhere(re + 1, text + 1, end);
+  return NULL;
+}
+
+int lk_matchre_builtin_span(const char *re, const char *text, size_t len, const char **start, const char **end) {
+  const char *stop = text + len;
+  if (re[0] == '^') {
+    const char *e = matchhere(re + 1, text, stop);
+    if (!e) return 0;
+    *start = text;
+    *end = e;
+    return 1;
+  }
+  if (re[0] != '\0' && re[0] != '.' && re[1] != '*' && !(re[0] == '$' && re[1] == '\0')) {
+    // a literal first character: memchr finds the only places a match can start
+    for (const char *t = text; t < stop && (t = (const char *)memchr(t, re[0], (size_t)(stop - t))) != NULL; t++) {
+      const char *e = matchhere(re, t, stop);
+      if (e) {
+        *start = t;
+        *end = e;
+        return 1;
+      }
+    }
+    return 0;
+  }
+  do {
+    const char *e = matchhere(re, text, stop);
+    if (e) {
+      *start = text;
+      *end = e;
+      return 1;
+    }
+  } while (text++ < stop);
+  return 0;
+}
+
+int lk_matchre_builtin(const char *re, const char *text, size_t len) {
+  const char *s, *e;
+  return lk_matchre_builtin_span(re, text, len, &s, &e);
+}
+
+// -------------------------
+// regex matching layer
+// -------------------------
+
+#if defined(LOGKNIFE_USE_PCRE2)
+
+void lk_re_free(lk_re_t *r) {
+  if (!r) return;
+  if (r->code) pcre2_code_free((pcre2_code *)r->code);
+  r->code = NULL;
+}
+
+bool lk_re_compile(lk_re_t *r, const char *pat) {
+  int errorcode = 0;
+  PCRE2_SIZE erroffset = 0;
+  r->pat = pat;
+  r->code = pcre2_compile((PCRE2_SPTR)pat, PCRE2_ZERO_TERMINATED, 0, &errorcode, &erroffset, NULL);
+  return r->code != NULL;
+}
+
+bool lk_re_match(const lk_re_t *r, const char *text, size_t len) {
+  if (!r || !r->code) return false;
+  pcre2_code *code = (pcre2_code *)r->code;
+  pcre2_match_data *md = pcre2_match_data_create_from_pattern(code, NULL);
+  if (!md) return false;
+  int rc = pcre2_match(code, (PCRE2_SPTR)text, len, 0, 0, md, NULL);
+  pcre2_match_data_free(md);
+  return rc >= 0;
+}
+
+bool lk_re_find(const lk_re_t *r, const char *text, size_t len, const char **start, size_t *mlen) {
+  if (!r || !r->code) return false;
+  pcre2_code *code = (pcre2_code *)r->code;
+  pcre2_match_data *md = pcre2_match_data_create_from_pattern(code, NULL);
+  if (!md) return false;
+  int rc = pcre2_match(code, (PCRE2_SPTR)text, len, 0, 0, md, NULL);
+  if (rc < 0) {
+    pcre2_match_data_free(md);
+    return false;
+  }
+  PCRE2_SIZE *ov = pcre2_get_ovector_pointer(md);
+  int g = (rc > 1 && ov[2] != PCRE2_UNSET) ? 1 : 0;
+  *start = text + ov[2 * g];
+  *mlen = (size_t)(ov[2 * g + 1] - ov[2 * g]);
+  pcre2_match_data_free(md);
+  return true;
+}
+
+#else
+
+void lk_re_free(lk_re_t *r) {
+  (void)r;
+}
+
+bool lk_re_compile(lk_re_t *r, const char *pat) {
+  r->pat = pat;
+  r->code = NULL;
+  return true;
+}
+
+bool lk_re_match(const lk_re_t *r, const char *text, size_t len) {
+  return lk_matchre_builtin(r->pat, text, len) != 0;
+}
+
+bool lk_re_find(const lk_re_t *r, const char *text, size_t len, const char **start, size_t *mlen) {
+  const char *s, *e;
+  if (!lk_matchre_builtin_span(r->pat, text, len, &s, &e)) return false;
+  *start = s;
+  *mlen = (size_t)(e - s);
+  return true;
+}
+
+#endif
+
+// -------------------------
+// rules
+// -------------------------
+
+struct lk_rules {
+  lk_re_t *re;          // includes first, then excludes
+  char **pat;           // owned copies; the built-in engine points into them
+  size_t include_count;
+  size_t count;
+};
+
+void lk_rules_free(lk_rules *rules) {
+  if (!rules) return;
+  for (size_t i = 0; i < rules->count; i++) {
+    lk_re_free(&rules->re[i]);
+    free(rules->pat[i]);
+  }
+  free(rules->re);
+  free(rules->pat);
+  free(rules);
+}
+
+lk_rules *lk_rules_compile(const char *const *include, size_t include_count,
+                           const char *const *exclude, size_t exclude_count,
+                           char *err, size_t err_len) {
+  size_t n = include_count + exclude_count;
+  lk_rules *rules = (lk_rules *)calloc(1, sizeof(lk_rules));
+  if (rules) {
+    rules->re = (lk_re_t *)calloc(n ? n : 1, sizeof(lk_re_t));
+    rules->pat = (char **)calloc(n ? n : 1, sizeof(char *));
+  }
+  if (!rules || !rules->re || !rules->pat) {
+    if (err && err_len) snprintf(err, err_len, "OOM");
+    lk_rules_free(rules);
+    return NULL;
+  }
+  rules->include_count = include_count;
+  for (size_t i = 0; i < n; i++) {
+    const char *pat = i < include_count ? include[i] : exclude[i - include_count];
+    size_t len = strlen(pat);
+    rules->pat[i] = (char *)malloc(len + 1);
+    if (!rules->pat[i]) {
+      if (err && err_len) snprintf(err, err_len, "OOM");
+      lk_rules_free(rules);
+      return NULL;
+    }
+    memcpy(rules->pat[i], pat, len + 1);
+    if (!lk_re_compile(&rules->re[i], rules->pat[i])) {
+      if (err && err_len) {
+        snprintf(err, err_len, "Failed to compile %s pattern: %s", i < include_count ? "include" : "exclude", pat);
+      }
+      free(rules->pat[i]);
+      lk_rules_free(rules);
+      return NULL;
+    }
+    rules->count++;
+  }
+  return rules;
+}
+
+int lk_rules_match_each(const lk_rules *rules, const char *line, size_t len,
+                        int all_includes, lk_rule_fn on_rule, void *user) {
+  if (rules->include_count > 0) {
+    bool ok = false;
+    for (size_t i = 0; i < rules->include_count && (!ok || all_includes); i++) {
+      bool m = lk_re_match(&rules->re[i], line, len);
+      if (on_rule) on_rule(user, i, m);
+      ok = ok || m;
+    }
+    if (!ok) return 0;
+  }
+  for (size_t i = rules->include_count; i < rules->count; i++) {
+    bool m = lk_re_match(&rules->re[i], line, len);
+    if (on_rule) on_rule(user, i, m);
+    if (m) return 0;
+  }
+  return 1;
+}
+
+int lk_rules_match(const lk_rules *rules, const char *line, size_t len) {
+  return lk_rules_match_each(rules, line, len, 0, NULL, NULL);
+}
+
+// -------------------------
+// stream
+// -------------------------
+
+void lk_stream_init(lk_stream *s, const lk_rules *rules, char *buf, size_t cap,
+                    lk_line_fn on_line, void *user) {
+  memset(s, 0, sizeof(*s));
+  s->rules = rules;
+  s->on_line = on_line;
+  s->user = user;
+  s->buf = buf;
+  s->cap = cap;
+}
+
+static void stream_line(lk_stream *s, const char *line, size_t len) {
+  if (len > 0 && line[len - 1] == '\r') len--;
+  s->lines++;
+  if (s->rules && !lk_rules_match(s->rules, line, len)) return;
+  s->kept++;
+  s->on_line(s->user, line, len);
+}
+
+// keep the start of a line split across pushes, up to cap bytes
+static void stream_hold(lk_stream *s, const char *data, size_t len) {
+  size_t room = s->cap - s->len;
+  if (len > room) {
+    s->overflow = 1;
+    len = room;
+  }
+  memcpy(s->buf + s->len, data, len);
+  s->len += len;
+}
+
+static void stream_flush_held(lk_stream *s) {
+  if (s->overflow) s->truncated++;
+  stream_line(s, s->buf, s->len);
+  s->len = 0;
+  s->overflow = 0;
+}
+
+void lk_stream_push(lk_stream *s, const char *data, size_t len) {
+  const char *p = data;
+  const char *end = data + len;
+  if (s->len > 0 || s->overflow) {
+    const char *nl = (const char *)memchr(p, '\n', len);
+    stream_hold(s, p, (size_t)((nl ? nl : end) - p));
+    if (!nl) return;
+    stream_flush_held(s);
+    p = nl + 1;
+  }
+  // whole lines straight from the caller's bytes
+  const char *nl;
+  while (p < end && (nl = (const char *)memchr(p, '\n', (size_t)(end - p))) != NULL) {
+    stream_line(s, p, (size_t)(nl - p));
+    p = nl + 1;
+  }
+  if (p < end) stream_hold(s, p, (size_t)(end - p));
+}
+
+void lk_stream_finish(lk_stream *s) {
+  if (s->len > 0 || s->overflow) stream_flush_held(s);
+}
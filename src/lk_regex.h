@@ -0,0 +1,27 @@
+// Regex layer shared by liblogknife and the CLI (not installed).
+// PCRE2 when built with LOGKNIFE_USE_PCRE2, else the built-in subset
+// (^ $ . *). All matching is bounded by an explicit length.
+
+#ifndef LK_REGEX_H
+#define LK_REGEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+  const char *pat;   // built-in engine: the pattern itself (not copied)
+  void *code;        // PCRE2: pcre2_code *
+} lk_re_t;
+
+bool lk_re_compile(lk_re_t *r, const char *pat);
+void lk_re_free(lk_re_t *r);
+bool lk_re_match(const lk_re_t *r, const char *text, size_t len);
+// Span of the first capture group, or of the whole match if there is none
+// (always the whole match for the built-in engine).
+bool lk_re_find(const lk_re_t *r, const char *text, size_t len, const char **start, size_t *mlen);
+
+// The built-in engine directly, whatever the build uses.
+int lk_matchre_builtin_span(const char *re, const char *text, size_t len, const char **start, const char **end);
+int lk_matchre_builtin(const char *re, const char *text, size_t len);
+
+#endif
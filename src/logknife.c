@@ -5,59 +5,64 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <signal.h>
+#include <math.h>
+#include <stdarg.h>
+#include <time.h>
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <io.h>
+#include <process.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
-#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <dirent.h>
 #endif
 
-#if defined(LOGKNIFE_USE_PCRE2)
-#define PCRE2_CODE_UNIT_WIDTH 8
-#include <pcre2.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LOGKNIFE_SSE2 1
+#include <emmintrin.h>
 #endif
 
-// Windows doesn't have strcasecmp in MSVC by default.
-#ifdef _WIN32
-#define strcasecmp _stricmp
+#if defined(_MSC_VER)
+#include <intrin.h>
 #endif
 
-// -------------------------
-// Built-in minimal regex (K&R / Pike style)
-// Supports: ^ $ . *
-// Reference: The Practice of Programming (classic)
-// -------------------------
-
-static int matchhere(const char *re, const char *text);
-
-static int matchstar(int c, const char *re, const char *text) {
-  const char *t = text;
-  do {
-    if (matchhere(re, t)) return 1;
-  } while (*t != '\0' && (*t++ == c || c == '.'));
-  return 0;
-}
+#include "logknife.h"
+#include "lk_regex.h"
+#ifndef _WIN32
+#include "logknife_ring.h"
+#endif
 
-static int matchhere(const char *re, const char *text) {
-  if (re[0] == '\0') return 1;
-  if (re[0] == '$' && re[1] == '\0') return *text == '\0';
-  if (re[1] == '*') return matchstar(re[0], re + 2, text);
-  if (*text != '\0' && (re[0] == '.' || re[0] == *text))
-    return matchhere(re + 1, text + 1);
-  return 0;
-}
+// Static tracepoints for perf/bpftrace (provider "logknife"), compiled in
+// with -DLOGKNIFE_USDT=ON. Disabled builds expand to nothing and never
+// evaluate the arguments.
+//   line_read(len)        a line entered the pipeline
+//   filter(len, matched)  the include/exclude/sample decision
+//   render(len)           a line is printed
+//   flush(printed)        stdout flushed; printed = lines printed so far
+#if defined(LOGKNIFE_USDT)
+#include <sys/sdt.h>
+#define LK_PROBE1(name, a) DTRACE_PROBE1(logknife, name, a)
+#define LK_PROBE2(name, a, b) DTRACE_PROBE2(logknife, name, a, b)
+#else
+#define LK_PROBE1(name, a) ((void)0)
+#define LK_PROBE2(name, a, b) ((void)0)
+#endif
 
-static int matchre_builtin(const char *re, const char *text) {
-  if (re[0] == '^') return matchhere(re + 1, text);
-  do {
-    if (matchhere(re, text)) return 1;
-  } while (*text++ != '\0');
-  return 0;
-}
+// Windows doesn't have strcasecmp in MSVC by default.
+#ifdef _WIN32
+#define strcasecmp _stricmp
+#endif
 
 // -------------------------
 // ANSI color helpers
@@ -86,31 +91,163 @@ static void sleep_ms(int ms) {
 #endif
 }
 
+// monotonic milliseconds, for periodic reports
+static int64_t now_ms(void) {
+#ifdef _WIN32
+  return (int64_t)GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+// monotonic nanoseconds, for stage timings
+static int64_t now_ns(void) {
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER c;
+  if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&c);
+  return (int64_t)((double)c.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+// wall clock, nanoseconds since the Unix epoch
+static int64_t wall_ns(void) {
+#ifdef _WIN32
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  ULARGE_INTEGER u;
+  u.LowPart = ft.dwLowDateTime;
+  u.HighPart = ft.dwHighDateTime;
+  return ((int64_t)u.QuadPart - 116444736000000000LL) * 100;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+static bool stdout_is_tty(void) {
+#ifdef _WIN32
+  return _isatty(_fileno(stdout)) != 0;
+#else
+  return isatty(fileno(stdout)) != 0;
+#endif
+}
+
+// Set by SIGINT so follow can print final reports before exiting.
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_sigint(int sig) {
+  (void)sig;
+  g_stop = 1;
+}
+
+// Set by SIGUSR1 to print --stats without stopping.
+static volatile sig_atomic_t g_dump_stats = 0;
+
+#ifdef SIGUSR1
+static void on_sigusr1(int sig) {
+  (void)sig;
+  g_dump_stats = 1;
+}
+#endif
+
+// Installs fn for sig. Unlike signal() on glibc, a blocking read is not
+// restarted: it fails with EINTR, so a stop request gets through even
+// while waiting on an idle pipe.
+static void on_signal(int sig, void (*fn)(int)) {
+#ifdef _WIN32
+  signal(sig, fn);
+#else
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = fn;
+  sigemptyset(&sa.sa_mask);
+  sigaction(sig, &sa, NULL);
+#endif
+}
+
 // -------------------------
 // small utils
 // -------------------------
 
-static char *strdup_s(const char *s) {
+// returns the new length
+static size_t rstrip_newlines(char *s) {
   size_t n = strlen(s);
+  while (n > 0 && (s[n - 1] == '\n' || s[n - 1] == '\r')) s[--n] = '\0';
+  return n;
+}
+
+static char *strndup_s(const char *s, size_t n) {
   char *p = (char *)malloc(n + 1);
   if (!p) return NULL;
-  memcpy(p, s, n + 1);
+  memcpy(p, s, n);
+  p[n] = '\0';
   return p;
 }
 
-static void rstrip_newlines(char *s) {
-  size_t n = strlen(s);
-  while (n > 0 && (s[n - 1] == '\n' || s[n - 1] == '\r')) s[--n] = '\0';
+// Replaces path with buf via a temp file and a rename, so a reader never
+// sees half a file; with sync the data is on disk before the rename.
+static bool write_file_atomic(const char *path, const char *buf, size_t len, bool sync) {
+  size_t n = strlen(path);
+  char *tmp = (char *)malloc(n + 5);
+  if (!tmp) return false;
+  memcpy(tmp, path, n);
+  memcpy(tmp + n, ".tmp", 5);
+  FILE *fp = fopen(tmp, "wb");
+  bool ok = fp && fwrite(buf, 1, len, fp) == len;
+  if (ok && sync) {
+#ifdef _WIN32
+    ok = fflush(fp) == 0 && _commit(_fileno(fp)) == 0;
+#else
+    ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+#endif
+  }
+  if (fp && fclose(fp) != 0) ok = false;
+#ifdef _WIN32
+  ok = ok && MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING);
+#else
+  ok = ok && rename(tmp, path) == 0;
+#endif
+  if (!ok) {
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    remove(tmp);
+  }
+  free(tmp);
+  return ok;
+}
+
+// FNV-1a with a murmur3 finalizer so low bits are usable for table indexing.
+static uint64_t hash_bytes(const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t h = 1469598103934665603ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
 }
 
 // -------------------------
 // highlight
 // -------------------------
 
-static void print_highlighted_plain(const char *line, const char **words, size_t word_count) {
+static void print_highlighted_plain(FILE *out, const char *line, const char **words, size_t word_count) {
   // Very simple highlighter: exact substring match.
   if (word_count == 0) {
-    fputs(line, stdout);
+    fputs(line, out);
     return;
   }
 
@@ -129,20 +266,20 @@ static void print_highlighted_plain(const char *line, const char **words, size_t
     }
 
     if (!best_pos) {
-      fputs(p, stdout);
+      fputs(p, out);
       return;
     }
 
-    fwrite(p, 1, (size_t)(best_pos - p), stdout);
+    fwrite(p, 1, (size_t)(best_pos - p), out);
 
     const char *w = words[best_i];
     const char *color = "\x1b[36m"; // cyan
     if (strcasecmp(w, "ERROR") == 0) color = "\x1b[31m";
     else if (strcasecmp(w, "WARN") == 0 || strcasecmp(w, "WARNING") == 0) color = "\x1b[33m";
 
-    fputs(color, stdout);
-    fputs(w, stdout);
-    fputs("\x1b[0m", stdout);
+    fputs(color, out);
+    fputs(w, out);
+    fputs("\x1b[0m", out);
 
     p = best_pos + strlen(w);
   }
@@ -153,7 +290,7 @@ static bool is_jsonish(const char *s) {
   return *s == '{' || *s == '[';
 }
 
-static void print_json_colorized(const char *line, const char **keys, size_t key_count) {
+static void print_json_colorized(FILE *out, const char *line, const char **keys, size_t key_count) {
   // Not a full JSON parser. A lightweight lexer that:
   // - colors strings
   // - colors numbers / booleans / null
@@ -215,9 +352,9 @@ static void print_json_colorized(const char *line, const char **keys, size_t key
         }
       }
 
-      fputs(color, stdout);
-      fwrite(start, 1, (size_t)(end - start), stdout);
-      fputs("\x1b[0m", stdout);
+      fputs(color, out);
+      fwrite(start, 1, (size_t)(end - start), out);
+      fputs("\x1b[0m", out);
       continue;
     }
 
@@ -225,9 +362,9 @@ static void print_json_colorized(const char *line, const char **keys, size_t key
       const char *start = p;
       p++;
       while (*p && (isdigit((unsigned char)*p) || *p == '.' || *p == 'e' || *p == 'E' || *p == '+' || *p == '-')) p++;
-      fputs("\x1b[33m", stdout); // yellow
-      fwrite(start, 1, (size_t)(p - start), stdout);
-      fputs("\x1b[0m", stdout);
+      fputs("\x1b[33m", out); // yellow
+      fwrite(start, 1, (size_t)(p - start), out);
+      fputs("\x1b[0m", out);
       continue;
     }
 
@@ -238,14 +375,14 @@ static void print_json_colorized(const char *line, const char **keys, size_t key
       else if (strncmp(p, "false", 5) == 0) len = 5;
       else len = 4;
 
-      fputs("\x1b[34m", stdout); // blue
-      fwrite(start, 1, len, stdout);
-      fputs("\x1b[0m", stdout);
+      fputs("\x1b[34m", out); // blue
+      fwrite(start, 1, len, out);
+      fputs("\x1b[0m", out);
       p += (int)len;
       continue;
     }
 
-    fputc(*p, stdout);
+    fputc(*p, out);
     p++;
   }
 }
@@ -254,6 +391,14 @@ static void print_json_colorized(const char *line, const char **keys, size_t key
 // CLI options
 // -------------------------
 
+typedef struct {
+  const char *pattern;
+  double above;          // fire when the rate exceeds this many lines/sec ...
+  long for_seconds;      // ... averaged over this long
+  long cooldown_seconds; // minimum time between two runs
+  const char *cmd;       // run through the shell, without waiting
+} trigger_spec_t;
+
 typedef struct {
   const char **include;
   size_t include_count;
@@ -272,6 +417,55 @@ typedef struct {
   long tail_lines;      // if > 0, print last N lines before following
   long since_seconds;   // if > 0 and tail_lines==0, approximates tail_lines
   double since_rate_lps; // lines per second for since->tail conversion
+
+  bool follow;          // false for `scan`: read to EOF, report, exit
+
+  const char *count_by; // field (or re:<pattern>) to aggregate matching lines on
+  long top_n;           // rows shown in count-by reports
+  long max_keys;        // exact keys kept before switching to a top-k sketch
+  long every_seconds;   // report interval while following
+  long window_seconds;  // sliding window for windowed aggregations (follow only)
+
+  const char *percentiles; // numeric field to report p50/p90/p95/p99 on
+  const char *distinct;    // field to estimate the number of distinct values of
+  bool rate_by_rule;       // per-include-pattern match rates
+  bool sparkline;          // draw rate history instead of just the current rate
+
+  trigger_spec_t *triggers;
+  size_t trigger_count;
+
+  bool templates;          // cluster lines into templates (Drain)
+
+  bool normalize;          // replace numbers, ids, IPs, timestamps with placeholders
+
+  double sample;           // keep this fraction of lines (0 = off), by hash ...
+  const char *sample_key;  // ... of this field, so a key is kept everywhere or nowhere
+  long reservoir;          // print a uniform sample of n matching lines per window
+
+  const char *limit_field; // rate limit printed lines per value of this field ...
+  double limit_rate;       // ... to this many lines/sec (bursts up to one second's worth)
+
+  bool stats;              // throughput/timing report on stderr
+  long stats_every_seconds;
+  bool profile_patterns;   // sampled per-pattern match cost, ranked on stderr at exit
+  const char *trace_path;  // Chrome trace events of sampled stage spans
+
+  const char *metrics_file;   // Prometheus text, rewritten atomically ...
+  long metrics_every_seconds; // ... this often
+  const char *metrics_socket; // Prometheus text served on a unix socket
+
+  const char *ring_path;      // publish printed lines into a shared-memory ring ...
+  int64_t ring_size;          // ... of this many bytes
+
+  const char *state_file;     // persist the read position here; resume from it
+
+  int64_t lag_warn_bytes;     // warn on stderr when this far behind end of file ...
+  long lag_warn_seconds;      // ... or behind the wall clock (line timestamps)
+
+  const char *record_start; // lines matching this start a record; others continue it
+
+  bool collapse;           // suppress recently repeated lines, print counts instead
+  bool collapse_mask;      // ... treating lines that differ only in numbers/ids as repeats
 } opts_t;
 
 static void usage(FILE *out) {
@@ -280,7 +474,19 @@ static void usage(FILE *out) {
     "\n"
     "Usage:\n"
     "  logknife follow <file> [options]\n"
-    "\n"
+    "  logknife scan <file|-> [options]   read to EOF, print reports, exit\n"
+    "  logknife bench [--format plain|json|logfmt|all] [--lines n] [--line-len n]\n"
+    "                 [--match-rate pct] [--include pattern] [--runs n] [--seed n]\n"
+    "  logknife bench follow [--interval ms] [--rate n/s] [--burst n] [--duration dur]\n"
+    "                 [--idle dur] [--catchup n]   follow latency, idle CPU, catch-up rate\n"
+#ifndef _WIN32
+    "  logknife serve <socket> <file>... [--interval ms] [--buffer size]\n"
+    "                 follow files once, stream them to subscribers on a unix socket\n"
+    "  logknife subscribe <socket> [--include pattern]... [--exclude pattern]...\n"
+    "  logknife ring <file> [--from-start] [--interval ms]   print lines published with --ring\n"
+#endif
+    "\n");
+  fprintf(out,
     "Options:\n"
     "  --include <pattern>      filter (repeatable)\n"
     "  --exclude <pattern>      negative filter (repeatable)\n"
@@ -291,6 +497,52 @@ static void usage(FILE *out) {
     "  --since <dur>            approximate tail by duration (e.g., 10m, 2h). Uses --rate (default: 1 line/sec)\n"
     "  --rate <lines-per-sec>   used with --since (default: 1)\n"
     "  --interval <ms>          polling interval (default: 200)\n"
+    "  --state-file <path>      save the read position; resume there next time, across rotation\n"
+    "  --stats                  throughput/timing report on stderr at exit"
+#ifdef SIGUSR1
+    " and on SIGUSR1"
+#endif
+    "\n"
+    "  --stats-every <dur>      ... and periodically\n"
+    "                           (follow adds detect/process latency percentiles)\n"
+    "  --profile-patterns       time 1 in 1024 lines per pattern; rank patterns by cost at exit\n"
+    "  --trace <file.json>      write sampled read/filter/render/flush spans as Chrome trace events\n"
+    "  --lag-warn-bytes <size>  warn on stderr when further than this behind end of file (follow)\n"
+    "  --lag-warn-seconds <dur> ... or when the last line's timestamp is this far behind the clock\n"
+    "  --metrics-file <path>    Prometheus text metrics, rewritten atomically every --metrics-every\n"
+    "  --metrics-every <dur>    ... (default: 10s) and at exit\n"
+#ifndef _WIN32
+    "  --metrics-socket <path>  serve Prometheus text metrics on a unix socket (plain or HTTP GET)\n"
+    "  --ring <file>            publish printed lines into a shared-memory ring instead of stdout\n"
+    "  --ring-size <size>       ... of this many bytes (default: 16M)\n"
+#endif
+    "  --normalize              replace numbers, hex ids, UUIDs, IPs, timestamps with <NUM> <HEX> ...\n"
+    "  --sample <pct>           keep about pct of lines (e.g. 1%%), chosen by hash before filtering\n"
+    "  --sample-key <field>     hash this field instead of the line (same ids kept across files)\n"
+    "  --reservoir <n>          print a random sample of n matching lines per --window/--every\n"
+    "  --limit-per <field> <n/s>  print at most n lines/sec per field value (also n/m, n/h)\n"
+    "  --record-start <pattern> a matching line starts a record; the lines up to the next one join it\n"
+    "  --collapse               replace repeats of recent lines with a count\n"
+    "  --collapse-mask          ... ignoring numbers, hex ids and UUIDs when comparing\n"
+    "\n"
+    "Aggregation (matching lines are counted instead of printed):\n"
+    "  --count-by <field>       count lines per value of a JSON/logfmt key, or re:<pattern> capture\n"
+    "  --top <n>                rows per report (default: 10)\n"
+    "  --max-keys <n>           exact keys before switching to a top-k sketch (default: 10000)\n"
+    "  --percentiles <field>    p50/p90/p95/p99 of a numeric field (HDR histogram)\n"
+    "  --distinct <field>       approximate distinct values of a field (HyperLogLog)\n"
+    "  --templates              cluster lines into templates (Drain); new ones are flagged while following\n"
+    "  --rate-by rule           match rate of each --include pattern\n"
+    "  --sparkline              show rate history per window slot\n"
+    "  --every <dur>            report interval while following (default: --window, or 10s)\n"
+    "  --window <dur>           only aggregate the last <dur> while following (e.g. 1m)\n"
+    "\n"
+    "Triggers (follow only; counted on every line, before --include/--exclude):\n"
+    "  --trigger <pattern>      start a trigger on lines matching pattern (repeatable)\n"
+    "  --above <n>[/s|/m|/h]    fire when its rate exceeds n lines per second/minute/hour\n"
+    "  --for <dur>              ... averaged over this long (default: 10s)\n"
+    "  --cooldown <dur>         minimum time between runs (default: 60s)\n"
+    "  --run <cmd>              shell command to start; gets LOGKNIFE_TRIGGER and LOGKNIFE_RATE\n"
     "\n"
     "Regex:\n"
 #if defined(LOGKNIFE_USE_PCRE2)
@@ -328,13 +580,67 @@ static long parse_duration_seconds(const char *s) {
   return n * mult;
 }
 
+static trigger_spec_t *last_trigger(opts_t *o, const char *flag) {
+  if (o->trigger_count == 0) {
+    fprintf(stderr, "%s needs a preceding --trigger\n", flag);
+    return NULL;
+  }
+  return &o->triggers[o->trigger_count - 1];
+}
+
+// "100", "100/s", "600/m", "3600/h" -> lines per second; < 0 if invalid
+static double parse_rate(const char *s) {
+  char *end = NULL;
+  double n = strtod(s, &end);
+  if (end == s || n <= 0.0) return -1.0;
+  if (*end == '\0' || strcmp(end, "/s") == 0) return n;
+  if (strcmp(end, "/m") == 0) return n / 60.0;
+  if (strcmp(end, "/h") == 0) return n / 3600.0;
+  return -1.0;
+}
+
+// "512", "64K", "10MB", "1G" -> bytes; < 0 if invalid
+static int64_t parse_size(const char *s) {
+  char *end = NULL;
+  double n = strtod(s, &end);
+  if (end == s || n < 0.0) return -1;
+  double mult = 1.0;
+  switch (toupper((unsigned char)*end)) {
+    case 'K': mult = 1024.0; end++; break;
+    case 'M': mult = 1024.0 * 1024.0; end++; break;
+    case 'G': mult = 1024.0 * 1024.0 * 1024.0; end++; break;
+    default: break;
+  }
+  if (toupper((unsigned char)*end) == 'B') end++;
+  if (*end != '\0') return -1;
+  return (int64_t)(n * mult);
+}
+
+// "1%" or "0.01" -> 0.01; < 0 if invalid
+static double parse_fraction(const char *s) {
+  char *end = NULL;
+  double v = strtod(s, &end);
+  if (end == s) return -1.0;
+  if (*end == '%') {
+    v /= 100.0;
+    end++;
+  }
+  if (*end != '\0' || v <= 0.0 || v > 1.0) return -1.0;
+  return v;
+}
+
 static int parse_args(int argc, char **argv, opts_t *o) {
   memset(o, 0, sizeof(*o));
   o->interval_ms = 200;
   o->since_rate_lps = 1.0;
+  o->top_n = 10;
+  o->max_keys = 10000;
+  o->metrics_every_seconds = 10;
+  o->ring_size = 16 << 20;
 
   if (argc < 3) return 0;
-  if (strcmp(argv[1], "follow") != 0) return 0;
+  if (strcmp(argv[1], "follow") == 0) o->follow = true;
+  else if (strcmp(argv[1], "scan") != 0) return 0;
 
   o->path = argv[2];
 
@@ -364,6 +670,164 @@ static int parse_args(int argc, char **argv, opts_t *o) {
     } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
       o->interval_ms = atoi(argv[++i]);
       if (o->interval_ms < 10) o->interval_ms = 10;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      o->stats = true;
+    } else if (strcmp(argv[i], "--stats-every") == 0 && i + 1 < argc) {
+      o->stats = true;
+      o->stats_every_seconds = parse_duration_seconds(argv[++i]);
+      if (o->stats_every_seconds <= 0) {
+        fprintf(stderr, "Invalid duration for --stats-every (use 10s/10m/2h/1d)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--lag-warn-bytes") == 0 && i + 1 < argc) {
+      o->lag_warn_bytes = parse_size(argv[++i]);
+      if (o->lag_warn_bytes <= 0) {
+        fprintf(stderr, "Invalid --lag-warn-bytes (use 512K, 10MB, 1G)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--lag-warn-seconds") == 0 && i + 1 < argc) {
+      o->lag_warn_seconds = parse_duration_seconds(argv[++i]);
+      if (o->lag_warn_seconds <= 0) {
+        fprintf(stderr, "Invalid duration for --lag-warn-seconds (use 10s/10m/2h/1d)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--metrics-file") == 0 && i + 1 < argc) {
+      o->metrics_file = argv[++i];
+    } else if (strcmp(argv[i], "--metrics-every") == 0 && i + 1 < argc) {
+      o->metrics_every_seconds = parse_duration_seconds(argv[++i]);
+      if (o->metrics_every_seconds <= 0) {
+        fprintf(stderr, "Invalid duration for --metrics-every (use 10s/10m/2h/1d)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--metrics-socket") == 0 && i + 1 < argc) {
+#ifdef _WIN32
+      fprintf(stderr, "--metrics-socket is not supported on Windows; use --metrics-file\n");
+      return 0;
+#else
+      o->metrics_socket = argv[++i];
+#endif
+    } else if (strcmp(argv[i], "--ring") == 0 && i + 1 < argc) {
+#ifdef _WIN32
+      fprintf(stderr, "--ring is not supported on Windows\n");
+      return 0;
+#else
+      o->ring_path = argv[++i];
+#endif
+    } else if (strcmp(argv[i], "--state-file") == 0 && i + 1 < argc) {
+      o->state_file = argv[++i];
+    } else if (strcmp(argv[i], "--ring-size") == 0 && i + 1 < argc) {
+      o->ring_size = parse_size(argv[++i]);
+      if (o->ring_size <= 0 || o->ring_size > ((int64_t)1 << 40)) {
+        fprintf(stderr, "Invalid --ring-size (e.g. 16M)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      o->trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--profile-patterns") == 0) {
+      o->profile_patterns = true;
+    } else if (strcmp(argv[i], "--normalize") == 0) {
+      o->normalize = true;
+    } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+      o->sample = parse_fraction(argv[++i]);
+      if (o->sample <= 0.0) {
+        fprintf(stderr, "Invalid --sample (use 1%% or 0.01)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--sample-key") == 0 && i + 1 < argc) {
+      o->sample_key = argv[++i];
+    } else if (strcmp(argv[i], "--reservoir") == 0 && i + 1 < argc) {
+      o->reservoir = strtol(argv[++i], NULL, 10);
+      if (o->reservoir < 1) {
+        fprintf(stderr, "Invalid --reservoir size\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--limit-per") == 0 && i + 2 < argc) {
+      o->limit_field = argv[++i];
+      o->limit_rate = parse_rate(argv[++i]);
+      if (o->limit_rate <= 0.0) {
+        fprintf(stderr, "Invalid rate for --limit-per (use 100/s, 600/m, 3600/h)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--record-start") == 0 && i + 1 < argc) {
+      o->record_start = argv[++i];
+    } else if (strcmp(argv[i], "--collapse") == 0) {
+      o->collapse = true;
+    } else if (strcmp(argv[i], "--collapse-mask") == 0) {
+      o->collapse = true;
+      o->collapse_mask = true;
+    } else if (strcmp(argv[i], "--count-by") == 0 && i + 1 < argc) {
+      o->count_by = argv[++i];
+    } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+      o->top_n = strtol(argv[++i], NULL, 10);
+      if (o->top_n < 1) o->top_n = 1;
+    } else if (strcmp(argv[i], "--max-keys") == 0 && i + 1 < argc) {
+      o->max_keys = strtol(argv[++i], NULL, 10);
+      if (o->max_keys < 1) o->max_keys = 1;
+    } else if (strcmp(argv[i], "--percentiles") == 0 && i + 1 < argc) {
+      o->percentiles = argv[++i];
+    } else if (strcmp(argv[i], "--distinct") == 0 && i + 1 < argc) {
+      o->distinct = argv[++i];
+    } else if (strcmp(argv[i], "--templates") == 0) {
+      o->templates = true;
+    } else if (strcmp(argv[i], "--rate-by") == 0 && i + 1 < argc) {
+      if (strcmp(argv[++i], "rule") != 0) {
+        fprintf(stderr, "Unsupported --rate-by: %s (only 'rule')\n", argv[i]);
+        return 0;
+      }
+      o->rate_by_rule = true;
+    } else if (strcmp(argv[i], "--sparkline") == 0) {
+      o->sparkline = true;
+    } else if (strcmp(argv[i], "--trigger") == 0 && i + 1 < argc) {
+      o->triggers = (trigger_spec_t *)realloc(o->triggers, sizeof(trigger_spec_t) * (o->trigger_count + 1));
+      if (!o->triggers) {
+        fprintf(stderr, "OOM\n");
+        exit(1);
+      }
+      trigger_spec_t *t = &o->triggers[o->trigger_count++];
+      memset(t, 0, sizeof(*t));
+      t->pattern = argv[++i];
+      t->for_seconds = 10;
+      t->cooldown_seconds = 60;
+    } else if (strcmp(argv[i], "--above") == 0 && i + 1 < argc) {
+      trigger_spec_t *t = last_trigger(o, argv[i]);
+      if (!t) return 0;
+      t->above = parse_rate(argv[++i]);
+      if (t->above <= 0.0) {
+        fprintf(stderr, "Invalid rate for --above (use 50/s, 300/m or 1000/h)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--for") == 0 && i + 1 < argc) {
+      trigger_spec_t *t = last_trigger(o, argv[i]);
+      if (!t) return 0;
+      t->for_seconds = parse_duration_seconds(argv[++i]);
+      if (t->for_seconds <= 0) {
+        fprintf(stderr, "Invalid duration for --for (use 10s/10m/2h/1d)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--cooldown") == 0 && i + 1 < argc) {
+      trigger_spec_t *t = last_trigger(o, argv[i]);
+      if (!t) return 0;
+      t->cooldown_seconds = parse_duration_seconds(argv[++i]);
+      if (t->cooldown_seconds < 0) {
+        fprintf(stderr, "Invalid duration for --cooldown (use 10s/10m/2h/1d)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--run") == 0 && i + 1 < argc) {
+      trigger_spec_t *t = last_trigger(o, argv[i]);
+      if (!t) return 0;
+      t->cmd = argv[++i];
+    } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+      o->window_seconds = parse_duration_seconds(argv[++i]);
+      if (o->window_seconds <= 0) {
+        fprintf(stderr, "Invalid duration for --window (use 10s/10m/2h/1d)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--every") == 0 && i + 1 < argc) {
+      o->every_seconds = parse_duration_seconds(argv[++i]);
+      if (o->every_seconds <= 0) {
+        fprintf(stderr, "Invalid duration for --every (use 10s/10m/2h/1d)\n");
+        return 0;
+      }
     } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
       return 0;
     } else {
@@ -372,239 +836,4988 @@ static int parse_args(int argc, char **argv, opts_t *o) {
     }
   }
 
+  for (size_t i = 0; i < o->trigger_count; i++) {
+    const trigger_spec_t *t = &o->triggers[i];
+    if (!o->follow || t->above <= 0.0 || !t->cmd) {
+      fprintf(stderr, "--trigger %s needs follow, --above and --run\n", t->pattern);
+      return 0;
+    }
+  }
+
+  if (o->sample_key && o->sample <= 0.0) {
+    fprintf(stderr, "--sample-key needs --sample\n");
+    return 0;
+  }
+
+  if (o->rate_by_rule && o->window_seconds == 0) o->window_seconds = 10;
+  if (o->every_seconds == 0) o->every_seconds = o->window_seconds > 0 ? o->window_seconds : 10;
+
   return 1;
 }
 
 // -------------------------
-// regex matching layer
+// rule sets
 // -------------------------
+// --include / --exclude are compiled once into an lk_rules (liblogknife),
+// which decides whether a line is kept; a ruleset_t holds one kind's
+// per-pattern counters, fed as lk_rules_match_each reports each evaluation.
+// With --profile-patterns the pipeline sets `timed` on one line in
+// PROFILE_EVERY and only those evaluations read the clock.
 
-#if defined(LOGKNIFE_USE_PCRE2)
+#define PROFILE_EVERY 1024
 
 typedef struct {
-  pcre2_code *code;
-} re_t;
+  uint64_t evals;
+  uint64_t hits;
+  uint64_t timed;       // sampled evaluations ...
+  int64_t timed_ns;     // ... and the time they took
+} rule_stats_t;
 
-static void re_free(re_t *r) {
-  if (!r) return;
-  if (r->code) pcre2_code_free(r->code);
-  r->code = NULL;
-}
+typedef struct {
+  const char **pat;
+  rule_stats_t *st;
+  size_t count;
+  bool timed;           // time matches on the current line
+} ruleset_t;
 
-static bool re_compile(re_t *r, const char *pat) {
-  int errorcode = 0;
-  PCRE2_SIZE erroffset = 0;
-  r->code = pcre2_compile((PCRE2_SPTR)pat, PCRE2_ZERO_TERMINATED, 0, &errorcode, &erroffset, NULL);
-  return r->code != NULL;
+static bool ruleset_init(ruleset_t *rs, const char **pats, size_t count) {
+  memset(rs, 0, sizeof(*rs));
+  if (count == 0) return true;
+  rs->st = (rule_stats_t *)calloc(count, sizeof(rule_stats_t));
+  if (!rs->st) return false;
+  rs->pat = pats;
+  rs->count = count;
+  return true;
 }
 
-static bool re_match(const re_t *r, const char *text) {
-  if (!r || !r->code) return false;
-  pcre2_match_data *md = pcre2_match_data_create_from_pattern(r->code, NULL);
-  if (!md) return false;
-  int rc = pcre2_match(r->code, (PCRE2_SPTR)text, strlen(text), 0, 0, md, NULL);
-  pcre2_match_data_free(md);
-  return rc >= 0;
+static void ruleset_free(ruleset_t *rs) {
+  free(rs->st);
 }
 
-#else
+typedef struct {
+  const ruleset_t *inc, *exc;
+  bool *hits;
+  int64_t t;            // clock at the previous evaluation, when timed
+} rule_eval_t;
+
+// lk_rule_fn: counts the evaluation (and times it, as the time since the
+// previous one) against its pattern.
+static void rule_evaluated(void *user, size_t rule, int matched) {
+  rule_eval_t *e = (rule_eval_t *)user;
+  bool inc = rule < e->inc->count;
+  const ruleset_t *rs = inc ? e->inc : e->exc;
+  size_t i = inc ? rule : rule - e->inc->count;
+  rule_stats_t *st = &rs->st[i];
+  if (rs->timed) {
+    int64_t t = now_ns();
+    st->timed_ns += t - e->t;
+    st->timed++;
+    e->t = t;
+  }
+  st->evals++;
+  st->hits += matched != 0;
+  if (inc && e->hits) e->hits[i] = matched != 0;
+}
 
 typedef struct {
+  const char *kind;
   const char *pat;
-} re_t;
+  const rule_stats_t *st;
+  double cost_ns;       // estimated total: sampled ns/eval * evals
+} profile_row_t;
 
-static void re_free(re_t *r) {
-  (void)r;
+static int profile_cmp_desc(const void *a, const void *b) {
+  double x = ((const profile_row_t *)a)->cost_ns, y = ((const profile_row_t *)b)->cost_ns;
+  return (x < y) - (x > y);
 }
 
-static bool re_compile(re_t *r, const char *pat) {
-  r->pat = pat;
-  return true;
+static size_t profile_rows(profile_row_t *rows, const char *kind, const ruleset_t *rs) {
+  for (size_t i = 0; i < rs->count; i++) {
+    const rule_stats_t *st = &rs->st[i];
+    rows[i].kind = kind;
+    rows[i].pat = rs->pat[i];
+    rows[i].st = st;
+    rows[i].cost_ns = st->timed ? (double)st->timed_ns / (double)st->timed * (double)st->evals : 0.0;
+  }
+  return rs->count;
 }
 
-static bool re_match(const re_t *r, const char *text) {
-  return matchre_builtin(r->pat, text) != 0;
-}
+// Patterns ranked by estimated total match time, with their selectivity.
+static void profile_report(FILE *out, const ruleset_t *inc, const ruleset_t *exc) {
+  size_t n = inc->count + exc->count;
+  if (n == 0) {
+    fprintf(out, "pattern profile: no --include/--exclude patterns\n");
+    return;
+  }
+  profile_row_t *rows = (profile_row_t *)malloc(n * sizeof(profile_row_t));
+  if (!rows) return;
+  size_t k = profile_rows(rows, "include", inc);
+  profile_rows(rows + k, "exclude", exc);
+  qsort(rows, n, sizeof(profile_row_t), profile_cmp_desc);
 
-#endif
+  double total = 0.0;
+  for (size_t i = 0; i < n; i++) total += rows[i].cost_ns;
+  fprintf(out, "pattern profile (1 in %d lines timed):\n", PROFILE_EVERY);
+  fprintf(out, "  %4s  %-8s %-28s %10s %6s %9s %12s %7s\n",
+          "rank", "kind", "pattern", "est. time", "share", "ns/eval", "evals", "hit%");
+  for (size_t i = 0; i < n; i++) {
+    const rule_stats_t *st = rows[i].st;
+    double per = st->timed ? (double)st->timed_ns / (double)st->timed : 0.0;
+    fprintf(out, "  %4zu  %-8s %-28s %9.3fs %5.1f%% %9.1f %12llu %6.2f%%\n", i + 1, rows[i].kind, rows[i].pat,
+            rows[i].cost_ns / 1e9, total > 0.0 ? rows[i].cost_ns / total * 100.0 : 0.0, per,
+            (unsigned long long)st->evals, st->evals ? (double)st->hits / (double)st->evals * 100.0 : 0.0);
+  }
+  free(rows);
+  fflush(out);
+}
 
 // -------------------------
-// follow implementation
+// field extraction
 // -------------------------
+// A field is a JSON key ("key": value), a logfmt key (key=value), with a
+// "re:" prefix the first capture group of a pattern, or "@line" for the
+// whole line (normalized with --normalize).
 
-static int64_t file_size(FILE *fp) {
-#ifdef _WIN32
-  int fd = _fileno(fp);
-  if (fd < 0) return -1;
-  __int64 cur = _telli64(fd);
-  __int64 end = _lseeki64(fd, 0, SEEK_END);
-  _lseeki64(fd, cur, SEEK_SET);
-  return (int64_t)end;
-#else
-  struct stat st;
-  if (fstat(fileno(fp), &st) != 0) return -1;
-  return (int64_t)st.st_size;
-#endif
+typedef struct {
+  const char *spec;
+  const char *key;
+  size_t key_len;
+  bool is_re;
+  bool is_line;
+  lk_re_t re;
+} field_t;
+
+static bool field_compile(field_t *f, const char *spec) {
+  memset(f, 0, sizeof(*f));
+  f->spec = spec;
+  if (strcmp(spec, "@line") == 0) {
+    f->is_line = true;
+    return true;
+  }
+  if (strncmp(spec, "re:", 3) == 0) {
+    f->is_re = true;
+    return lk_re_compile(&f->re, spec + 3);
+  }
+  f->key = spec;
+  f->key_len = strlen(spec);
+  return f->key_len > 0;
+}
+
+static void field_free(field_t *f) {
+  if (f->is_re) lk_re_free(&f->re);
 }
 
-static bool should_print(const opts_t *o, const re_t *includes, const re_t *excludes, const char *line) {
-  char *tmp = strdup_s(line);
-  if (!tmp) return true;
-  rstrip_newlines(tmp);
+static bool json_value_at(const char *p, const char **val, size_t *len) {
+  while (*p == ' ' || *p == '\t') p++;
+  if (*p != ':') return false;
+  p++;
+  while (*p == ' ' || *p == '\t') p++;
 
-  if (o->include_count > 0) {
-    bool ok = false;
-    for (size_t i = 0; i < o->include_count; i++) {
-      if (re_match(&includes[i], tmp)) { ok = true; break; }
+  const char *start = p;
+  if (*p == '"') {
+    start = ++p;
+    while (*p && *p != '"') {
+      if (*p == '\\' && p[1]) p++;
+      p++;
     }
-    if (!ok) { free(tmp); return false; }
-  }
-
-  for (size_t i = 0; i < o->exclude_count; i++) {
-    if (re_match(&excludes[i], tmp)) { free(tmp); return false; }
+  } else {
+    while (*p && *p != ',' && *p != '}' && *p != ']' && !isspace((unsigned char)*p)) p++;
+    if (p == start) return false;
   }
-
-  free(tmp);
+  *val = start;
+  *len = (size_t)(p - start);
   return true;
 }
 
-static int print_line(const opts_t *o, const char *line) {
-  if (o->json_mode && is_jsonish(line)) {
-    print_json_colorized(line, o->json_keys, o->json_key_count);
+static bool logfmt_value_at(const char *p, const char **val, size_t *len) {
+  const char *start = p;
+  if (*p == '"') {
+    start = ++p;
+    while (*p && *p != '"') {
+      if (*p == '\\' && p[1]) p++;
+      p++;
+    }
   } else {
-    print_highlighted_plain(line, o->highlight, o->highlight_count);
+    while (*p && !isspace((unsigned char)*p)) p++;
   }
-  return 0;
+  *val = start;
+  *len = (size_t)(p - start);
+  return true;
 }
 
-static int tail_last_lines(FILE *fp, long n, const opts_t *o, const re_t *includes, const re_t *excludes) {
-  if (n <= 0) return 0;
-
-  // Read backwards in blocks and count newlines.
-  const size_t block = 4096;
-  int64_t end = file_size(fp);
-  if (end < 0) return 0;
-
-  int64_t pos = end;
-  long found = 0;
-  char *buf = (char *)malloc(block);
-  if (!buf) return 0;
+static bool field_get(const field_t *f, const char *line, const char **val, size_t *len) {
+  if (f->is_re) return lk_re_find(&f->re, line, strlen(line), val, len);
+  if (f->is_line) {
+    *val = line;
+    *len = strlen(line);
+    return true;
+  }
 
-  while (pos > 0 && found <= n) {
-    size_t to_read = block;
-    if (pos < (int64_t)block) to_read = (size_t)pos;
-    pos -= (int64_t)to_read;
-    fseek(fp, (long)pos, SEEK_SET);
-    size_t got = fread(buf, 1, to_read, fp);
-    for (size_t i = got; i > 0; i--) {
-      if (buf[i - 1] == '\n') {
-        found++;
-        if (found > n) {
-          pos += (int64_t)i;
-          goto done;
-        }
-      }
+  for (const char *p = strstr(line, f->key); p; p = strstr(p + 1, f->key)) {
+    const char *after = p + f->key_len;
+    if (p > line && p[-1] == '"' && *after == '"') {
+      if (json_value_at(after + 1, val, len)) return true;
+    } else if ((p == line || isspace((unsigned char)p[-1])) && *after == '=') {
+      return logfmt_value_at(after + 1, val, len);
     }
   }
+  return false;
+}
 
-  pos = 0;
+// -------------------------
+// count-by: exact counts, then Space-Saving top-k
+// -------------------------
+// Keys are counted exactly until max_keys distinct keys have been seen. From
+// then on the table is frozen at max_keys counters and updated with
+// Space-Saving (Metwally et al.): an unseen key evicts the current minimum and
+// inherits its count, which is remembered as the key's error bound. Heavy
+// hitters stay accurate while memory stays fixed.
 
- done:
-  free(buf);
-  fseek(fp, (long)pos, SEEK_SET);
+typedef struct {
+  char *key;
+  size_t len;
+  uint64_t hash;
+  uint64_t count;
+  uint64_t err;     // overestimation bound (sketch mode)
+  size_t heap_pos;
+} topk_entry_t;
 
-  // Now print from pos to end.
-  char line[8192];
-  while (fgets(line, (int)sizeof(line), fp)) {
-    if (!should_print(o, includes, excludes, line)) continue;
-    print_line(o, line);
-  }
+typedef struct {
+  topk_entry_t *e;
+  size_t n, cap;
+  uint32_t *slots;  // linear probing table: entry index + 1, 0 = empty
+  size_t nslots;    // power of two, kept under 75% load
+  size_t *heap;     // min-heap of entry indices by count (sketch mode only)
+  size_t max_keys;
+  bool sketch;
+  uint64_t total;
+  uint64_t missing; // lines without the field
+} topk_t;
 
-  return 0;
+static void topk_init(topk_t *t, size_t max_keys) {
+  memset(t, 0, sizeof(*t));
+  t->max_keys = max_keys > 0 ? max_keys : 1;
 }
 
-static int cmd_follow(const opts_t *o) {
-  FILE *fp = fopen(o->path, "rb");
-  if (!fp) {
-    fprintf(stderr, "Failed to open %s: %s\n", o->path, strerror(errno));
-    return 1;
-  }
-
-  // compile patterns
-  re_t *includes = NULL;
-  re_t *excludes = NULL;
+static void topk_free(topk_t *t) {
+  for (size_t i = 0; i < t->n; i++) free(t->e[i].key);
+  free(t->e);
+  free(t->slots);
+  free(t->heap);
+  memset(t, 0, sizeof(*t));
+}
 
-  if (o->include_count) {
-    includes = (re_t *)calloc(o->include_count, sizeof(re_t));
-    if (!includes) return 1;
-    for (size_t i = 0; i < o->include_count; i++) {
-      if (!re_compile(&includes[i], o->include[i])) {
-        fprintf(stderr, "Failed to compile include pattern: %s\n", o->include[i]);
-        return 1;
-      }
-    }
+static size_t topk_probe(const topk_t *t, const char *key, size_t len, uint64_t h) {
+  size_t mask = t->nslots - 1;
+  size_t i = (size_t)h & mask;
+  for (;;) {
+    uint32_t s = t->slots[i];
+    if (s == 0) return i;
+    const topk_entry_t *e = &t->e[s - 1];
+    if (e->hash == h && e->len == len && memcmp(e->key, key, len) == 0) return i;
+    i = (i + 1) & mask;
   }
+}
 
-  if (o->exclude_count) {
-    excludes = (re_t *)calloc(o->exclude_count, sizeof(re_t));
-    if (!excludes) return 1;
-    for (size_t i = 0; i < o->exclude_count; i++) {
-      if (!re_compile(&excludes[i], o->exclude[i])) {
-        fprintf(stderr, "Failed to compile exclude pattern: %s\n", o->exclude[i]);
-        return 1;
-      }
-    }
+static bool topk_rehash(topk_t *t, size_t nslots) {
+  uint32_t *slots = (uint32_t *)calloc(nslots, sizeof(uint32_t));
+  if (!slots) return false;
+  free(t->slots);
+  t->slots = slots;
+  t->nslots = nslots;
+  for (size_t i = 0; i < t->n; i++) {
+    size_t slot = topk_probe(t, t->e[i].key, t->e[i].len, t->e[i].hash);
+    t->slots[slot] = (uint32_t)(i + 1);
   }
+  return true;
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones.
+static void topk_unlink(topk_t *t, size_t slot) {
+  size_t mask = t->nslots - 1;
+  size_t i = slot;
+  size_t j = slot;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (t->slots[j] == 0) break;
+    size_t k = (size_t)t->e[t->slots[j] - 1].hash & mask;
+    bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+    if (stays) continue;
+    t->slots[i] = t->slots[j];
+    i = j;
+  }
+  t->slots[i] = 0;
+}
+
+static void topk_sift_down(topk_t *t, size_t pos) {
+  for (;;) {
+    size_t l = 2 * pos + 1, r = l + 1, m = pos;
+    if (l < t->n && t->e[t->heap[l]].count < t->e[t->heap[m]].count) m = l;
+    if (r < t->n && t->e[t->heap[r]].count < t->e[t->heap[m]].count) m = r;
+    if (m == pos) return;
+    size_t tmp = t->heap[pos];
+    t->heap[pos] = t->heap[m];
+    t->heap[m] = tmp;
+    t->e[t->heap[pos]].heap_pos = pos;
+    t->e[t->heap[m]].heap_pos = m;
+    pos = m;
+  }
+}
+
+static bool topk_enter_sketch(topk_t *t) {
+  t->heap = (size_t *)malloc(sizeof(size_t) * t->n);
+  if (!t->heap) return false;
+  for (size_t i = 0; i < t->n; i++) {
+    t->heap[i] = i;
+    t->e[i].heap_pos = i;
+  }
+  for (size_t i = t->n / 2; i-- > 0;) topk_sift_down(t, i);
+  t->sketch = true;
+  return true;
+}
+
+static bool topk_add(topk_t *t, const char *key, size_t len) {
+  t->total++;
+  uint64_t h = hash_bytes(key, len);
+  if (!t->slots && !topk_rehash(t, 64)) return false;
+
+  size_t slot = topk_probe(t, key, len, h);
+  if (t->slots[slot]) {
+    size_t idx = t->slots[slot] - 1;
+    t->e[idx].count++;
+    if (t->sketch) topk_sift_down(t, t->e[idx].heap_pos);
+    return true;
+  }
+
+  if (t->n < t->max_keys) {
+    if (t->n == t->cap) {
+      size_t cap = t->cap ? t->cap * 2 : 64;
+      if (cap > t->max_keys) cap = t->max_keys;
+      topk_entry_t *e = (topk_entry_t *)realloc(t->e, sizeof(topk_entry_t) * cap);
+      if (!e) return false;
+      t->e = e;
+      t->cap = cap;
+    }
+    if ((t->n + 1) * 4 > t->nslots * 3) {
+      if (!topk_rehash(t, t->nslots * 2)) return false;
+      slot = topk_probe(t, key, len, h);
+    }
+    char *k = strndup_s(key, len);
+    if (!k) return false;
+    topk_entry_t *e = &t->e[t->n];
+    e->key = k;
+    e->len = len;
+    e->hash = h;
+    e->count = 1;
+    e->err = 0;
+    e->heap_pos = 0;
+    t->slots[slot] = (uint32_t)(t->n + 1);
+    t->n++;
+    return true;
+  }
+
+  if (!t->sketch && !topk_enter_sketch(t)) return false;
+
+  char *k = strndup_s(key, len);
+  if (!k) return false;
+  size_t idx = t->heap[0];
+  topk_entry_t *m = &t->e[idx];
+  topk_unlink(t, topk_probe(t, m->key, m->len, m->hash));
+  free(m->key);
+  m->key = k;
+  m->len = len;
+  m->hash = h;
+  m->err = m->count;
+  m->count++;
+  t->slots[topk_probe(t, key, len, h)] = (uint32_t)(idx + 1);
+  topk_sift_down(t, 0);
+  return true;
+}
+
+static int topk_cmp_desc(const void *a, const void *b) {
+  const topk_entry_t *x = *(const topk_entry_t *const *)a;
+  const topk_entry_t *y = *(const topk_entry_t *const *)b;
+  if (x->count != y->count) return x->count < y->count ? 1 : -1;
+  // equal counts sort by key, so reports don't depend on hash order
+  int c = memcmp(x->key, y->key, x->len < y->len ? x->len : y->len);
+  if (c != 0) return c;
+  return x->len < y->len ? -1 : x->len > y->len;
+}
+
+static void topk_report(FILE *out, const topk_t *t, const char *title, long top_n) {
+  fprintf(out, "count-by %s: %llu lines, %zu keys%s\n", title,
+          (unsigned long long)t->total, t->n,
+          t->sketch ? " (top-k sketch, counts are upper bounds)" : "");
+
+  const topk_entry_t **sorted = (const topk_entry_t **)malloc(sizeof(*sorted) * (t->n ? t->n : 1));
+  if (!sorted) return;
+  for (size_t i = 0; i < t->n; i++) sorted[i] = &t->e[i];
+  qsort((void *)sorted, t->n, sizeof(*sorted), topk_cmp_desc);
+
+  size_t shown = (top_n > 0 && (size_t)top_n < t->n) ? (size_t)top_n : t->n;
+  for (size_t i = 0; i < shown; i++) {
+    const topk_entry_t *e = sorted[i];
+    fprintf(out, "%10llu  %.*s", (unsigned long long)e->count, (int)e->len, e->key);
+    if (e->err) fprintf(out, "  (+/-%llu)", (unsigned long long)e->err);
+    fputc('\n', out);
+  }
+  if (t->missing) fprintf(out, "%10llu  (no %s)\n", (unsigned long long)t->missing, title);
+  free((void *)sorted);
+}
+
+// -------------------------
+// sliding windows
+// -------------------------
+// A window is split into time slots; windowed aggregators keep one state per
+// slot and merge the live ones when reporting. A zero-length window is a single
+// slot that never expires (scan mode, or follow without --window).
+
+#define WINDOW_SLOTS 10
+
+typedef struct {
+  int64_t window_ms;
+  int64_t slot_ms;
+  size_t nslots;
+  int64_t head;     // absolute slot number of the current slot
+} window_t;
+
+static void window_init(window_t *w, int64_t window_ms, int64_t now) {
+  memset(w, 0, sizeof(*w));
+  w->nslots = 1;
+  if (window_ms <= 0) return;
+  w->window_ms = window_ms;
+  w->slot_ms = window_ms / WINDOW_SLOTS;
+  if (w->slot_ms < 1000) w->slot_ms = 1000;
+  w->nslots = (size_t)((window_ms + w->slot_ms - 1) / w->slot_ms);
+  w->head = now / w->slot_ms;
+}
+
+static size_t window_cur(const window_t *w) {
+  return (size_t)(w->head % (int64_t)w->nslots);
+}
+
+// Moves the window to now. Returns how many slots expired; they start at
+// *first and wrap around, and the caller must clear them.
+static size_t window_advance(window_t *w, int64_t now, size_t *first) {
+  if (w->window_ms <= 0) return 0;
+  int64_t epoch = now / w->slot_ms;
+  if (epoch <= w->head) return 0;
+  int64_t n = epoch - w->head;
+  if (n > (int64_t)w->nslots) n = (int64_t)w->nslots;
+  *first = (size_t)((w->head + 1) % (int64_t)w->nslots);
+  w->head = epoch;
+  return (size_t)n;
+}
+
+static void print_window_label(FILE *out, const window_t *w) {
+  if (w->window_ms <= 0) return;
+  long sec = (long)(w->window_ms / 1000);
+  if (sec % 3600 == 0) fprintf(out, " (last %ldh)", sec / 3600);
+  else if (sec % 60 == 0) fprintf(out, " (last %ldm)", sec / 60);
+  else fprintf(out, " (last %lds)", sec);
+}
+
+// -------------------------
+// percentiles: HDR-style log-linear histogram
+// -------------------------
+// Values are scaled to thousandths and bucketed with 7 bits of mantissa per
+// power of two, so any percentile is within ~1% of the true value in a fixed
+// ~30 KB per histogram. Histograms merge by adding buckets, which is how
+// window slots are combined (and how per-thread state would be).
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_BUCKETS (HIST_SUB + (64 - HIST_SUB_BITS) * HIST_HALF)
+#define HIST_SCALE 1000.0
+
+typedef struct {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t min, max;
+} hist_t;
+
+static int msb64(uint64_t v) {
+  int r = 0;
+  if (v >> 32) { v >>= 32; r += 32; }
+  if (v >> 16) { v >>= 16; r += 16; }
+  if (v >> 8) { v >>= 8; r += 8; }
+  if (v >> 4) { v >>= 4; r += 4; }
+  if (v >> 2) { v >>= 2; r += 2; }
+  if (v >> 1) r += 1;
+  return r;
+}
+
+static size_t hist_index(uint64_t v) {
+  if (v < HIST_SUB) return (size_t)v;
+  int shift = msb64(v) - (HIST_SUB_BITS - 1);
+  uint64_t sub = v >> shift;
+  return HIST_SUB + (size_t)(shift - 1) * HIST_HALF + (size_t)(sub - HIST_HALF);
+}
+
+// midpoint of the bucket's value range
+static uint64_t hist_value(size_t idx) {
+  if (idx < HIST_SUB) return (uint64_t)idx;
+  size_t k = idx - HIST_SUB;
+  int shift = (int)(k / HIST_HALF) + 1;
+  uint64_t sub = (uint64_t)(k % HIST_HALF) + HIST_HALF;
+  return (sub << shift) + ((uint64_t)1 << (shift - 1));
+}
+
+static void hist_reset(hist_t *h) {
+  memset(h, 0, sizeof(*h));
+}
+
+static void hist_record(hist_t *h, uint64_t v) {
+  h->counts[hist_index(v)]++;
+  if (h->total == 0 || v < h->min) h->min = v;
+  if (v > h->max) h->max = v;
+  h->total++;
+}
+
+static void hist_record_n(hist_t *h, uint64_t v, uint64_t n) {
+  if (n == 0) return;
+  h->counts[hist_index(v)] += n;
+  if (h->total == 0 || v < h->min) h->min = v;
+  if (v > h->max) h->max = v;
+  h->total += n;
+}
+
+static void hist_merge(hist_t *dst, const hist_t *src) {
+  if (src->total == 0) return;
+  for (size_t i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += src->counts[i];
+  if (dst->total == 0 || src->min < dst->min) dst->min = src->min;
+  if (src->max > dst->max) dst->max = src->max;
+  dst->total += src->total;
+}
+
+static uint64_t hist_quantile(const hist_t *h, double q) {
+  if (h->total == 0) return 0;
+  uint64_t rank = (uint64_t)(q * (double)h->total + 0.5);
+  if (rank < 1) rank = 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      uint64_t v = hist_value(i);
+      if (v < h->min) v = h->min;
+      if (v > h->max) v = h->max;
+      return v;
+    }
+  }
+  return h->max;
+}
+
+typedef struct {
+  hist_t *slots;     // one histogram per window slot
+  hist_t *merged;    // scratch for reports
+  window_t win;
+  uint64_t invalid;  // lines where the field is missing or not a number
+} quant_t;
+
+static bool quant_init(quant_t *q, int64_t window_ms, int64_t now) {
+  memset(q, 0, sizeof(*q));
+  window_init(&q->win, window_ms, now);
+  q->slots = (hist_t *)calloc(q->win.nslots, sizeof(hist_t));
+  q->merged = (hist_t *)calloc(1, sizeof(hist_t));
+  return q->slots && q->merged;
+}
+
+static void quant_free(quant_t *q) {
+  free(q->slots);
+  free(q->merged);
+}
+
+static void quant_advance(quant_t *q, int64_t now) {
+  size_t first = 0;
+  size_t n = window_advance(&q->win, now, &first);
+  for (size_t i = 0; i < n; i++) hist_reset(&q->slots[(first + i) % q->win.nslots]);
+}
+
+static void quant_add(quant_t *q, const char *val, size_t len, int64_t now) {
+  char num[64];
+  if (len == 0 || len >= sizeof(num)) {
+    q->invalid++;
+    return;
+  }
+  memcpy(num, val, len);
+  num[len] = '\0';
+  char *end = NULL;
+  double d = strtod(num, &end);
+  if (end == num || d < 0.0 || d != d) {
+    q->invalid++;
+    return;
+  }
+  quant_advance(q, now);
+  double scaled = d * HIST_SCALE;
+  uint64_t v = scaled >= 1.8e19 ? UINT64_MAX : (uint64_t)(scaled + 0.5);
+  hist_record(&q->slots[window_cur(&q->win)], v);
+}
+
+static void quant_report(FILE *out, quant_t *q, const char *title, int64_t now) {
+  quant_advance(q, now);
+  hist_t *m = q->merged;
+  hist_reset(m);
+  for (size_t i = 0; i < q->win.nslots; i++) hist_merge(m, &q->slots[i]);
+
+  fprintf(out, "percentiles %s", title);
+  print_window_label(out, &q->win);
+  fprintf(out, ": n=%llu", (unsigned long long)m->total);
+  if (m->total > 0) {
+    fprintf(out, " min=%.4g p50=%.4g p90=%.4g p95=%.4g p99=%.4g max=%.4g",
+            (double)m->min / HIST_SCALE,
+            (double)hist_quantile(m, 0.50) / HIST_SCALE,
+            (double)hist_quantile(m, 0.90) / HIST_SCALE,
+            (double)hist_quantile(m, 0.95) / HIST_SCALE,
+            (double)hist_quantile(m, 0.99) / HIST_SCALE,
+            (double)m->max / HIST_SCALE);
+  }
+  if (q->invalid) fprintf(out, " (skipped %llu)", (unsigned long long)q->invalid);
+  fputc('\n', out);
+}
+
+// -------------------------
+// distinct: HyperLogLog
+// -------------------------
+// 2^12 one-byte registers (4 KB) per sketch give ~1.6% standard error at any
+// cardinality. Sketches merge by taking the register-wise max, so a window is
+// one sketch per slot.
+
+#define HLL_P 12
+#define HLL_M (1u << HLL_P)
+
+typedef struct {
+  uint8_t regs[HLL_M];
+} hll_t;
+
+static void hll_add(hll_t *h, uint64_t hash) {
+  size_t idx = (size_t)(hash >> (64 - HLL_P));
+  uint64_t w = (hash << HLL_P) | ((uint64_t)1 << (HLL_P - 1));
+  uint8_t rank = (uint8_t)(64 - msb64(w));
+  if (rank > h->regs[idx]) h->regs[idx] = rank;
+}
+
+static void hll_merge(hll_t *dst, const hll_t *src) {
+  for (size_t i = 0; i < HLL_M; i++) {
+    if (src->regs[i] > dst->regs[i]) dst->regs[i] = src->regs[i];
+  }
+}
+
+static double hll_estimate(const hll_t *h) {
+  double m = (double)HLL_M;
+  double alpha = 0.7213 / (1.0 + 1.079 / m);
+  double sum = 0.0;
+  size_t zeros = 0;
+  for (size_t i = 0; i < HLL_M; i++) {
+    sum += 1.0 / (double)((uint64_t)1 << h->regs[i]);
+    if (h->regs[i] == 0) zeros++;
+  }
+  double est = alpha * m * m / sum;
+  // small range: linear counting is more accurate
+  if (est <= 2.5 * m && zeros > 0) est = m * log(m / (double)zeros);
+  return est;
+}
+
+typedef struct {
+  hll_t *slots;      // one sketch per window slot
+  uint64_t *lines;   // lines seen per window slot
+  hll_t merged;      // scratch for reports
+  window_t win;
+  uint64_t missing;  // lines without the field
+} distinct_t;
+
+static bool distinct_init(distinct_t *d, int64_t window_ms, int64_t now) {
+  memset(d, 0, sizeof(*d));
+  window_init(&d->win, window_ms, now);
+  d->slots = (hll_t *)calloc(d->win.nslots, sizeof(hll_t));
+  d->lines = (uint64_t *)calloc(d->win.nslots, sizeof(uint64_t));
+  return d->slots && d->lines;
+}
+
+static void distinct_free(distinct_t *d) {
+  free(d->slots);
+  free(d->lines);
+}
+
+static void distinct_advance(distinct_t *d, int64_t now) {
+  size_t first = 0;
+  size_t n = window_advance(&d->win, now, &first);
+  for (size_t i = 0; i < n; i++) {
+    size_t slot = (first + i) % d->win.nslots;
+    memset(&d->slots[slot], 0, sizeof(hll_t));
+    d->lines[slot] = 0;
+  }
+}
+
+static void distinct_add(distinct_t *d, const char *val, size_t len, int64_t now) {
+  distinct_advance(d, now);
+  size_t cur = window_cur(&d->win);
+  hll_add(&d->slots[cur], hash_bytes(val, len));
+  d->lines[cur]++;
+}
+
+static void distinct_report(FILE *out, distinct_t *d, const char *title, int64_t now) {
+  distinct_advance(d, now);
+  memset(&d->merged, 0, sizeof(hll_t));
+  uint64_t lines = 0;
+  for (size_t i = 0; i < d->win.nslots; i++) {
+    hll_merge(&d->merged, &d->slots[i]);
+    lines += d->lines[i];
+  }
+  fprintf(out, "distinct %s", title);
+  print_window_label(out, &d->win);
+  fprintf(out, ": ~%.0f (%llu lines", hll_estimate(&d->merged), (unsigned long long)lines);
+  if (d->missing) fprintf(out, ", %llu without %s", (unsigned long long)d->missing, title);
+  fputs(")\n", out);
+}
+
+// -------------------------
+// rates: ring-buffered per-rule counters
+// -------------------------
+// One counter per rule per window slot. The oldest slot is reused as time
+// moves on, so a rate is just the ring's sum over the time it covers.
+
+typedef struct {
+  uint64_t *counts;  // nrules x nslots
+  size_t nrules;
+  window_t win;
+  int64_t start;     // rates before the window has filled use elapsed time
+} rates_t;
+
+static bool rates_init(rates_t *r, size_t nrules, int64_t window_ms, int64_t now) {
+  memset(r, 0, sizeof(*r));
+  window_init(&r->win, window_ms, now);
+  r->nrules = nrules;
+  r->start = now;
+  r->counts = (uint64_t *)calloc(nrules * r->win.nslots, sizeof(uint64_t));
+  return r->counts != NULL;
+}
+
+static void rates_free(rates_t *r) {
+  free(r->counts);
+}
+
+static void rates_advance(rates_t *r, int64_t now) {
+  size_t first = 0;
+  size_t n = window_advance(&r->win, now, &first);
+  for (size_t i = 0; i < n; i++) {
+    size_t slot = (first + i) % r->win.nslots;
+    for (size_t k = 0; k < r->nrules; k++) r->counts[k * r->win.nslots + slot] = 0;
+  }
+}
+
+static void rates_hit(rates_t *r, size_t rule, int64_t now) {
+  rates_advance(r, now);
+  r->counts[rule * r->win.nslots + window_cur(&r->win)]++;
+}
+
+static uint64_t rates_sum(const rates_t *r, size_t rule) {
+  uint64_t sum = 0;
+  const uint64_t *c = &r->counts[rule * r->win.nslots];
+  for (size_t i = 0; i < r->win.nslots; i++) sum += c[i];
+  return sum;
+}
+
+// Until the window has filled, the ring's sum over the elapsed time. After
+// that the rate is over the last (nslots - 1) slots' worth of time: the
+// current partial slot, the full ones, and the share of the oldest slot that
+// is still inside that span. Dividing the whole ring by less than nslots slots
+// would count the oldest slot in full and overstate the rate.
+static double rates_per_sec(const rates_t *r, size_t rule, int64_t now) {
+  double sum = (double)rates_sum(r, rule);
+  int64_t span = now - r->start;
+  const window_t *w = &r->win;
+  if (w->window_ms > 0 && span >= (int64_t)w->nslots * w->slot_ms) {
+    if (w->nslots == 1) return sum * 1000.0 / (double)w->slot_ms;
+    size_t oldest = (size_t)((w->head + 1) % (int64_t)w->nslots);
+    double part = (double)(now % w->slot_ms) / (double)w->slot_ms;
+    sum -= (double)r->counts[rule * w->nslots + oldest] * part;
+    span = (int64_t)(w->nslots - 1) * w->slot_ms;
+  }
+  if (span < 1) span = 1;
+  return sum * 1000.0 / (double)span;
+}
+
+static void print_sparkline(FILE *out, const rates_t *r, size_t rule) {
+  static const char *bars[] = { " ", "\xe2\x96\x81", "\xe2\x96\x82", "\xe2\x96\x83", "\xe2\x96\x84",
+                                "\xe2\x96\x85", "\xe2\x96\x86", "\xe2\x96\x87", "\xe2\x96\x88" };
+  const uint64_t *c = &r->counts[rule * r->win.nslots];
+  uint64_t max = 0;
+  for (size_t i = 0; i < r->win.nslots; i++) if (c[i] > max) max = c[i];
+  // oldest slot first
+  for (size_t i = 1; i <= r->win.nslots; i++) {
+    uint64_t v = c[(window_cur(&r->win) + i) % r->win.nslots];
+    size_t level = v == 0 ? 0 : 1 + (size_t)((v * 7) / (max ? max : 1));
+    fputs(bars[level], out);
+  }
+}
+
+static void rates_report(FILE *out, rates_t *r, const char **names, bool sparkline, int64_t now) {
+  rates_advance(r, now);
+  fputs("rate", out);
+  print_window_label(out, &r->win);
+  fputs(":\n", out);
+  for (size_t k = 0; k < r->nrules; k++) {
+    fprintf(out, "%10.1f/s %10llu  ", rates_per_sec(r, k, now), (unsigned long long)rates_sum(r, k));
+    if (sparkline) {
+      print_sparkline(out, r, k);
+      fputs("  ", out);
+    }
+    fprintf(out, "%s\n", names[k]);
+  }
+}
+
+// -------------------------
+// triggers: run a command when a rate spikes
+// -------------------------
+// Each trigger counts its pattern into a ring of window slots covering --for.
+// Rates are checked once per read batch, never per line, and the command runs
+// as a child that is polled, not waited for, so following never stalls.
+
+typedef struct {
+  const trigger_spec_t *spec;
+  lk_re_t re;
+  rates_t rate;
+  int64_t last_fired;  // 0 = never
+  intptr_t child;      // running command, 0 = none
+} trigger_t;
+
+// Starts cmd through the shell. Returns a handle for child_running(), 0 on failure.
+static intptr_t spawn_shell(const char *cmd, const char *name, double rate) {
+  char rate_s[32];
+  snprintf(rate_s, sizeof(rate_s), "%.1f", rate);
+#ifdef _WIN32
+  _putenv_s("LOGKNIFE_TRIGGER", name);
+  _putenv_s("LOGKNIFE_RATE", rate_s);
+  intptr_t h = _spawnlp(_P_NOWAIT, "cmd.exe", "cmd.exe", "/c", cmd, NULL);
+  return h == -1 ? 0 : h;
+#else
+  pid_t pid = fork();
+  if (pid < 0) return 0;
+  if (pid == 0) {
+    setenv("LOGKNIFE_TRIGGER", name, 1);
+    setenv("LOGKNIFE_RATE", rate_s, 1);
+    int devnull = open("/dev/null", O_RDONLY);
+    if (devnull >= 0) {
+      dup2(devnull, 0);
+      close(devnull);
+    }
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+  return (intptr_t)pid;
+#endif
+}
+
+// Reaps the child once it has exited.
+static bool child_running(intptr_t child) {
+#ifdef _WIN32
+  if (WaitForSingleObject((HANDLE)child, 0) == WAIT_TIMEOUT) return true;
+  CloseHandle((HANDLE)child);
+  return false;
+#else
+  int status;
+  return waitpid((pid_t)child, &status, WNOHANG) == 0;
+#endif
+}
+
+static bool trigger_init(trigger_t *t, const trigger_spec_t *spec, int64_t now) {
+  memset(t, 0, sizeof(*t));
+  t->spec = spec;
+  if (!lk_re_compile(&t->re, spec->pattern)) {
+    fprintf(stderr, "Failed to compile trigger pattern: %s\n", spec->pattern);
+    return false;
+  }
+  return rates_init(&t->rate, 1, (int64_t)spec->for_seconds * 1000, now);
+}
+
+static void trigger_free(trigger_t *t) {
+  lk_re_free(&t->re);
+  rates_free(&t->rate);
+}
+
+static void trigger_eval(trigger_t *t, int64_t now) {
+  if (t->child && !child_running(t->child)) t->child = 0;
+
+  rates_advance(&t->rate, now);
+  // only judge a full window
+  if (now - t->rate.start < t->rate.win.window_ms) return;
+  double rate = rates_per_sec(&t->rate, 0, now);
+  if (rate <= t->spec->above) return;
+  if (t->child) return;
+  if (t->last_fired && now - t->last_fired < (int64_t)t->spec->cooldown_seconds * 1000) return;
+
+  fprintf(stderr, "logknife: trigger '%s' fired (%.1f/s > %g/s over %lds)\n",
+          t->spec->pattern, rate, t->spec->above, t->spec->for_seconds);
+  t->last_fired = now;
+  t->child = spawn_shell(t->spec->cmd, t->spec->pattern, rate);
+  if (!t->child) fprintf(stderr, "logknife: failed to run: %s\n", t->spec->cmd);
+}
+
+// -------------------------
+// normalize: mask variable parts of a line
+// -------------------------
+// One pass over the line. Everything up to the next digit is copied verbatim;
+// the digit search runs 16 bytes at a time with SSE2 where available. Every
+// placeholder contains a digit, so only a digit can start one. Around a digit
+// the surrounding word is classified with a character class table and
+// rewritten as <UUID>, <TS>, <IP>, <HEX> or <NUM>; other words keep their
+// letters and only their digit runs become <NUM> (12ms -> <NUM>ms). The
+// result goes into a reusable buffer.
+
+enum {
+  CC_DIGIT = 1,
+  CC_HEX = 2,    // 0-9 a-f A-F
+  CC_ALPHA = 4,
+  CC_WORD = 8,   // alnum plus the separators that occur inside ids: - . : _
+};
+
+static unsigned char k_cc[256];
+
+static void cc_init(void) {
+  static bool done = false;
+  if (done) return;
+  for (int c = 0; c < 256; c++) {
+    unsigned char v = 0;
+    if (c >= '0' && c <= '9') v |= CC_DIGIT | CC_HEX | CC_WORD;
+    if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) v |= CC_HEX;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) v |= CC_ALPHA | CC_WORD;
+    if (c == '-' || c == '.' || c == ':' || c == '_') v |= CC_WORD;
+    k_cc[c] = v;
+  }
+  done = true;
+}
+
+static int ctz32(unsigned v) {
+#if defined(_MSC_VER)
+  unsigned long idx;
+  _BitScanForward(&idx, v);
+  return (int)idx;
+#else
+  return __builtin_ctz(v);
+#endif
+}
+
+static size_t find_digit(const char *s, size_t n, size_t i) {
+#ifdef LOGKNIFE_SSE2
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i nine = _mm_set1_epi8(9);
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(const void *)(s + i)), zero);
+    // unsigned v <= 9  <=>  min(v, 9) == v
+    int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, nine), v));
+    if (m) return i + (size_t)ctz32((unsigned)m);
+  }
+#endif
+  for (; i < n; i++) {
+    if (k_cc[(unsigned char)s[i]] & CC_DIGIT) return i;
+  }
+  return n;
+}
+
+static size_t span_class(const char *s, size_t n, unsigned char cls) {
+  size_t i = 0;
+  while (i < n && (k_cc[(unsigned char)s[i]] & cls)) i++;
+  return i;
+}
+
+static bool is_uuid(const char *t, size_t n) {
+  static const size_t dash[] = { 8, 13, 18, 23 };
+  if (n != 36) return false;
+  for (size_t i = 0, d = 0; i < n; i++) {
+    if (d < 4 && i == dash[d]) {
+      if (t[i] != '-') return false;
+      d++;
+    } else if (!(k_cc[(unsigned char)t[i]] & CC_HEX)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// 2024-01-02..., or a time of day like 12:34 / 12:34:56.789
+static bool is_timestamp(const char *t, size_t n) {
+  if (n >= 10 && span_class(t, 4, CC_DIGIT) == 4 && t[4] == '-' &&
+      span_class(t + 5, 2, CC_DIGIT) == 2 && t[7] == '-' && span_class(t + 8, 2, CC_DIGIT) == 2) {
+    return true;
+  }
+  size_t h = span_class(t, n, CC_DIGIT);
+  if (h < 1 || h > 2 || h + 3 > n || t[h] != ':' || span_class(t + h + 1, 2, CC_DIGIT) != 2) return false;
+  size_t i = h + 3;
+  if (i < n && t[i] == ':') {
+    if (span_class(t + i + 1, n - i - 1, CC_DIGIT) != 2) return false;
+    i += 3;
+    if (i < n && t[i] == '.') i += 1 + span_class(t + i + 1, n - i - 1, CC_DIGIT);
+  }
+  return i == n;
+}
+
+// dotted quad, optionally with :port
+static bool is_ipv4(const char *t, size_t n) {
+  size_t i = 0;
+  for (int part = 0; part < 4; part++) {
+    size_t d = span_class(t + i, n - i, CC_DIGIT);
+    if (d < 1 || d > 3) return false;
+    i += d;
+    if (part < 3) {
+      if (i >= n || t[i] != '.') return false;
+      i++;
+    }
+  }
+  if (i < n && t[i] == ':') i += 1 + span_class(t + i + 1, n - i - 1, CC_DIGIT);
+  return i == n;
+}
+
+static bool is_hex_id(const char *t, size_t n) {
+  if (n > 2 && t[0] == '0' && (t[1] == 'x' || t[1] == 'X')) return span_class(t + 2, n - 2, CC_HEX) == n - 2;
+  if (n < 8 || span_class(t, n, CC_HEX) != n) return false;
+  return span_class(t, n, CC_DIGIT) != n;
+}
+
+static bool is_number(const char *t, size_t n) {
+  size_t i = span_class(t, n, CC_DIGIT);
+  if (i < n && t[i] == '.') i += 1 + span_class(t + i + 1, n - i - 1, CC_DIGIT);
+  return i == n;
+}
+
+typedef struct {
+  char *buf;
+  size_t cap;
+} norm_t;
+
+static void norm_free(norm_t *n) {
+  free(n->buf);
+}
+
+static size_t norm_put(char *out, const char *s) {
+  size_t n = strlen(s);
+  memcpy(out, s, n);
+  return n;
+}
+
+// Rewrites the word t[0..n) into out; returns bytes written.
+static size_t norm_word(char *out, const char *t, size_t n) {
+  if (is_uuid(t, n)) return norm_put(out, "<UUID>");
+  if (is_timestamp(t, n)) return norm_put(out, "<TS>");
+  if (is_ipv4(t, n)) return norm_put(out, "<IP>");
+  if (is_number(t, n)) return norm_put(out, "<NUM>");
+  if (is_hex_id(t, n)) return norm_put(out, "<HEX>");
+
+  size_t o = 0;
+  for (size_t i = 0; i < n;) {
+    if (!(k_cc[(unsigned char)t[i]] & CC_DIGIT)) {
+      out[o++] = t[i++];
+      continue;
+    }
+    i += span_class(t + i, n - i, CC_DIGIT);
+    if (i + 1 < n && t[i] == '.' && (k_cc[(unsigned char)t[i + 1]] & CC_DIGIT)) {
+      i += 1 + span_class(t + i + 1, n - i - 1, CC_DIGIT);
+    }
+    o += norm_put(out + o, "<NUM>");
+  }
+  return o;
+}
+
+// Returns the normalized line (valid until the next call), or the input on OOM.
+static const char *normalize_line(norm_t *nb, const char *line, size_t *out_len) {
+  cc_init();
+  size_t n = strlen(line);
+  // worst case: every byte a one-digit word becoming "<NUM>"
+  size_t need = n * 5 + 1;
+  if (need > nb->cap) {
+    char *b = (char *)realloc(nb->buf, need);
+    if (!b) {
+      *out_len = n;
+      return line;
+    }
+    nb->buf = b;
+    nb->cap = need;
+  }
+
+  char *out = nb->buf;
+  size_t o = 0;
+  size_t i = 0;
+  while (i < n) {
+    size_t d = find_digit(line, n, i);
+    memcpy(out + o, line + i, d - i);
+    o += d - i;
+    if (d == n) break;
+
+    // widen to the whole word; the part before the digit was copied verbatim
+    size_t s = d;
+    while (s > i && (k_cc[(unsigned char)line[s - 1]] & CC_WORD)) s--;
+    size_t e = d + span_class(line + d, n - d, CC_WORD);
+    // separators at the edges are punctuation, not part of the value
+    while (s < d && !(k_cc[(unsigned char)line[s]] & (CC_DIGIT | CC_ALPHA))) s++;
+    while (e > d + 1 && !(k_cc[(unsigned char)line[e - 1]] & (CC_DIGIT | CC_ALPHA))) e--;
+
+    o -= d - s;
+    o += norm_word(out + o, line + s, e - s);
+    i = e;
+  }
+  out[o] = '\0';
+  *out_len = o;
+  return out;
+}
+
+// Notes about lines not printed one by one ([suppressed ...], [repeated
+// ...], [sampled ...]) go where the lines go: the pipeline sets note_fn so
+// they reach --ring too. Without one they are dimmed on stdout.
+typedef void (*note_fn)(void *arg, const char *text);
+
+static void emit_note(note_fn fn, void *arg, const char *text) {
+  if (fn) fn(arg, text);
+  else printf("\x1b[90m%s\x1b[0m\n", text);
+}
+
+// -------------------------
+// limit: per-key token buckets
+// -------------------------
+// One token bucket per field value, in a fixed open-addressing table keyed by
+// hash (a short copy of the key is kept only for messages). A key whose bucket
+// has refilled completely behaves exactly like an unseen key, so idle keys are
+// dropped whenever the table fills; if that is not enough, the least recently
+// seen quarter is evicted after reporting what it suppressed.
+
+#define LIMIT_MAX_KEYS 4096
+#define LIMIT_KEY_SHOWN 63
+#define LIMIT_SUMMARY_MS 5000
+
+typedef struct {
+  uint64_t hash;
+  double tokens;
+  int64_t last;          // ms of the last refill
+  uint64_t seen;         // recency stamp for eviction
+  uint64_t suppressed;   // since the last summary
+  bool used;
+  char key[LIMIT_KEY_SHOWN + 1];
+} limit_entry_t;
+
+typedef struct {
+  limit_entry_t *e;
+  size_t nslots;         // power of two, LIMIT_MAX_KEYS fill at most 75%
+  size_t n;
+  double rate, burst;
+  uint64_t clock;
+  int64_t next_summary;
+  const char *name;
+  note_fn note;          // [suppressed ...] lines
+  void *note_arg;
+} limiter_t;
+
+static bool limiter_init(limiter_t *l, const char *name, double rate, int64_t now) {
+  memset(l, 0, sizeof(*l));
+  l->name = name;
+  l->rate = rate;
+  l->burst = rate < 1.0 ? 1.0 : rate;
+  l->nslots = 1;
+  while (l->nslots * 3 < LIMIT_MAX_KEYS * 4) l->nslots *= 2;
+  l->e = (limit_entry_t *)calloc(l->nslots, sizeof(limit_entry_t));
+  l->next_summary = now + LIMIT_SUMMARY_MS;
+  return l->e != NULL;
+}
+
+static void limiter_free(limiter_t *l) {
+  free(l->e);
+}
+
+static void limiter_refill(const limiter_t *l, limit_entry_t *e, int64_t now) {
+  e->tokens += (double)(now - e->last) * l->rate / 1000.0;
+  if (e->tokens > l->burst) e->tokens = l->burst;
+  e->last = now;
+}
+
+static void limiter_emit(const limiter_t *l, limit_entry_t *e) {
+  if (!e->suppressed) return;
+  char text[LIMIT_KEY_SHOWN + 128];
+  snprintf(text, sizeof(text), "[suppressed %llu line%s for %s=%s]", (unsigned long long)e->suppressed,
+           e->suppressed == 1 ? "" : "s", l->name, e->key);
+  emit_note(l->note, l->note_arg, text);
+  e->suppressed = 0;
+}
+
+static void limiter_summary(limiter_t *l, int64_t now) {
+  for (size_t i = 0; i < l->nslots; i++) {
+    if (l->e[i].used) limiter_emit(l, &l->e[i]);
+  }
+  l->next_summary = now + LIMIT_SUMMARY_MS;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Rebuilds the table without idle keys, then without the least recently
+// seen quarter if it is still over 75% of LIMIT_MAX_KEYS. Returns false if
+// nothing could be made room for (out of memory); the table is unchanged.
+static bool limiter_evict(limiter_t *l, int64_t now) {
+  uint64_t *ages = (uint64_t *)malloc(sizeof(uint64_t) * (l->n ? l->n : 1));
+  limit_entry_t *fresh = (limit_entry_t *)calloc(l->nslots, sizeof(limit_entry_t));
+  if (!ages || !fresh) {
+    free(ages);
+    free(fresh);
+    return false;
+  }
+  uint64_t cutoff = 0;
+  size_t live = 0;
+  for (size_t i = 0; i < l->nslots; i++) {
+    limit_entry_t *e = &l->e[i];
+    if (!e->used) continue;
+    limiter_refill(l, e, now);
+    if (e->tokens >= l->burst && !e->suppressed) continue;  // idle: like an unseen key
+    ages[live++] = e->seen;
+  }
+  if (live * 4 > LIMIT_MAX_KEYS * 3) {
+    qsort(ages, live, sizeof(uint64_t), cmp_u64);
+    cutoff = ages[live / 4];
+  }
+  free(ages);
+
+  limit_entry_t *old = l->e;
+  size_t mask = l->nslots - 1;
+  l->n = 0;
+  for (size_t i = 0; i < l->nslots; i++) {
+    limit_entry_t *e = &old[i];
+    if (!e->used || (e->tokens >= l->burst && !e->suppressed)) continue;
+    if (e->seen < cutoff) {
+      limiter_emit(l, e);
+      continue;
+    }
+    size_t j = (size_t)e->hash & mask;
+    while (fresh[j].used) j = (j + 1) & mask;
+    fresh[j] = *e;
+    l->n++;
+  }
+  free(old);
+  l->e = fresh;
+  return true;
+}
+
+// Returns true if a line with this key may be printed now.
+static bool limiter_allow(limiter_t *l, const char *key, size_t len, int64_t now) {
+  uint64_t h = hash_bytes(key, len);
+  size_t mask = l->nslots - 1;
+  size_t i = (size_t)h & mask;
+  while (l->e[i].used && l->e[i].hash != h) i = (i + 1) & mask;
+
+  limit_entry_t *e = &l->e[i];
+  if (!e->used) {
+    if (l->n >= LIMIT_MAX_KEYS) {
+      // without room for the key it cannot be limited; let the line through
+      if (!limiter_evict(l, now)) return true;
+      return limiter_allow(l, key, len, now);
+    }
+    memset(e, 0, sizeof(*e));
+    e->used = true;
+    e->hash = h;
+    e->tokens = l->burst;
+    e->last = now;
+    size_t shown = len < LIMIT_KEY_SHOWN ? len : LIMIT_KEY_SHOWN;
+    memcpy(e->key, key, shown);
+    e->key[shown] = '\0';
+    l->n++;
+  } else {
+    limiter_refill(l, e, now);
+  }
+  e->seen = ++l->clock;
+
+  if (e->tokens >= 1.0) {
+    e->tokens -= 1.0;
+    return true;
+  }
+  e->suppressed++;
+  return false;
+}
+
+// -------------------------
+// sampling
+// -------------------------
+// --sample keeps a line when the hash of its key falls under the sampling
+// fraction: no state, the same key is kept in every file and every run, and it
+// runs before filtering so dropped lines cost one hash. --reservoir keeps a
+// uniform sample of the lines that would be printed (Algorithm R) and prints
+// it, in arrival order, when the window closes.
+
+static bool sample_keep(uint64_t hash, double fraction) {
+  return (double)(hash >> 11) * (1.0 / 9007199254740992.0) < fraction;
+}
+
+typedef struct {
+  char *line;
+  size_t cap;
+  uint64_t seq;
+} reservoir_slot_t;
+
+typedef struct {
+  reservoir_slot_t *slot;
+  size_t size;
+  uint64_t seen;        // lines offered this window
+  uint64_t rng;
+  int64_t window_ms;
+  int64_t next_emit;
+} reservoir_t;
+
+static uint64_t xorshift64(uint64_t *s) {
+  uint64_t x = *s;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *s = x;
+}
+
+static bool reservoir_init(reservoir_t *r, size_t size, int64_t window_ms, int64_t now) {
+  memset(r, 0, sizeof(*r));
+  r->size = size;
+  r->window_ms = window_ms;
+  r->next_emit = now + window_ms;
+  r->rng = hash_bytes(&now, sizeof(now)) | 1;
+  r->slot = (reservoir_slot_t *)calloc(size, sizeof(reservoir_slot_t));
+  return r->slot != NULL;
+}
+
+static void reservoir_free(reservoir_t *r) {
+  for (size_t i = 0; i < r->size; i++) free(r->slot[i].line);
+  free(r->slot);
+}
+
+static void reservoir_offer(reservoir_t *r, const char *line) {
+  uint64_t i = r->seen++;
+  size_t k;
+  if (i < r->size) k = (size_t)i;
+  else {
+    uint64_t j = xorshift64(&r->rng) % (i + 1);
+    if (j >= r->size) return;
+    k = (size_t)j;
+  }
+  reservoir_slot_t *s = &r->slot[k];
+  size_t n = strlen(line);
+  if (n + 1 > s->cap) {
+    char *b = (char *)realloc(s->line, n + 1);
+    if (!b) return;
+    s->line = b;
+    s->cap = n + 1;
+  }
+  memcpy(s->line, line, n + 1);
+  s->seq = i;
+}
+
+static int reservoir_cmp_seq(const void *a, const void *b) {
+  const reservoir_slot_t *x = (const reservoir_slot_t *)a, *y = (const reservoir_slot_t *)b;
+  return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+// -------------------------
+// collapse: "last message repeated N times"
+// -------------------------
+// Lines are hashed into a small LRU of recently printed lines. A hit is
+// suppressed and counted; the counts are printed before the next new line,
+// when an entry is evicted, or after COLLAPSE_FLUSH_MS while following, so a
+// retry loop costs one line per flush instead of one per repeat. Alternating
+// repeats (A B A B) collapse too. With masking the hash is taken over the
+// normalized line.
+
+#define COLLAPSE_SLOTS 16
+#define COLLAPSE_SAMPLE 120
+#define COLLAPSE_FLUSH_MS 2000
+
+typedef struct {
+  uint64_t hash;
+  uint64_t repeats;   // suppressed since the last summary
+  uint64_t used;      // LRU stamp, 0 = empty
+  char sample[COLLAPSE_SAMPLE + 1];
+} collapse_entry_t;
+
+typedef struct {
+  collapse_entry_t e[COLLAPSE_SLOTS];
+  uint64_t clock;
+  size_t pending;        // entries with repeats > 0
+  int64_t pending_since;
+  norm_t norm;           // masked copy of the line
+  note_fn note;          // [repeated ...] lines
+  void *note_arg;
+} collapse_t;
+
+static void collapse_emit(const collapse_t *c, collapse_entry_t *e) {
+  char text[COLLAPSE_SAMPLE + 64];
+  snprintf(text, sizeof(text), "[repeated %llu time%s] %s", (unsigned long long)e->repeats,
+           e->repeats == 1 ? "" : "s", e->sample);
+  emit_note(c->note, c->note_arg, text);
+  e->repeats = 0;
+}
+
+static void collapse_flush(collapse_t *c) {
+  if (c->pending == 0) return;
+  // least recently repeated first
+  for (;;) {
+    collapse_entry_t *oldest = NULL;
+    for (size_t i = 0; i < COLLAPSE_SLOTS; i++) {
+      collapse_entry_t *e = &c->e[i];
+      if (e->repeats && (!oldest || e->used < oldest->used)) oldest = e;
+    }
+    if (!oldest) break;
+    collapse_emit(c, oldest);
+  }
+  c->pending = 0;
+}
+
+// Returns true if the line should be printed.
+static bool collapse_line(collapse_t *c, const char *line, bool mask, int64_t now) {
+  size_t len = 0;
+  const char *key = line;
+  if (mask) key = normalize_line(&c->norm, line, &len);
+  else len = strlen(line);
+  uint64_t h = hash_bytes(key, len);
+
+  collapse_entry_t *victim = &c->e[0];
+  for (size_t i = 0; i < COLLAPSE_SLOTS; i++) {
+    collapse_entry_t *e = &c->e[i];
+    if (e->used && e->hash == h) {
+      if (e->repeats++ == 0) {
+        if (c->pending++ == 0) c->pending_since = now;
+      }
+      e->used = ++c->clock;
+      return false;
+    }
+    if (e->used < victim->used) victim = e;
+  }
+
+  collapse_flush(c);
+  victim->hash = h;
+  victim->repeats = 0;
+  victim->used = ++c->clock;
+  size_t n = strlen(line);
+  if (n > COLLAPSE_SAMPLE) n = COLLAPSE_SAMPLE;
+  memcpy(victim->sample, line, n);
+  victim->sample[n] = '\0';
+  return true;
+}
+
+static void collapse_free(collapse_t *c) {
+  norm_free(&c->norm);
+}
+
+// -------------------------
+// templates: Drain log clustering
+// -------------------------
+// Drain (He et al., ICWS 2017) routes a line through a fixed-depth tree:
+// token count, then the first DRAIN_DEPTH tokens (tokens containing digits
+// are parameters and route through a wildcard child), reaching a small leaf list
+// of clusters. The line joins the most similar cluster if at least
+// DRAIN_SIM of its tokens match, and differing positions become <*>. Each
+// line does one tree walk plus a scan of one leaf, so cost is close to
+// tokenizing. Clusters and children are capped for bounded memory.
+
+#define DRAIN_DEPTH 2
+#define DRAIN_SIM 0.5
+#define DRAIN_MAX_CHILDREN 100
+#define DRAIN_MAX_TOKENS 128
+#define DRAIN_MAX_CLUSTERS 5000
+
+typedef struct drain_node {
+  uint64_t key;                 // token hash (token count below the root)
+  struct drain_node *child;
+  size_t nchild, child_cap;
+  size_t *cluster;              // leaves only: indices into drain_t.c
+  size_t ncluster, cluster_cap;
+} drain_node_t;
+
+typedef struct {
+  size_t ntok;
+  char **tok;       // NULL = <*>
+  uint64_t *hash;
+  uint64_t count;
+  uint32_t id;
+} drain_cluster_t;
+
+typedef struct {
+  drain_node_t root;
+  drain_cluster_t *c;
+  size_t n, cap;
+  uint64_t lines;
+  uint64_t overflow;             // lines that needed a new cluster past the cap
+  const char *tok[DRAIN_MAX_TOKENS];
+  size_t len[DRAIN_MAX_TOKENS];
+  uint64_t hash[DRAIN_MAX_TOKENS];
+  bool var[DRAIN_MAX_TOKENS];    // token looks like a number/id
+} drain_t;
+
+static const uint64_t k_drain_wild = 0x9e3779b97f4a7c15ULL;
+
+// Drain's heuristic: a token with a digit in it is a parameter.
+static bool token_is_variable(const char *t, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (isdigit((unsigned char)t[i])) return true;
+  }
+  return false;
+}
+
+// Token children are capped: past the cap, new tokens share the <*> child.
+// Token-count children under the root are not (at most DRAIN_MAX_TOKENS).
+static drain_node_t *drain_child(drain_node_t *node, uint64_t key, bool capped) {
+  for (size_t i = 0; i < node->nchild; i++) {
+    if (node->child[i].key == key) return &node->child[i];
+  }
+  if (capped && node->nchild >= DRAIN_MAX_CHILDREN - 1 && key != k_drain_wild) {
+    return drain_child(node, k_drain_wild, false);
+  }
+  if (node->nchild == node->child_cap) {
+    size_t cap = node->child_cap ? node->child_cap * 2 : 4;
+    drain_node_t *c = (drain_node_t *)realloc(node->child, sizeof(drain_node_t) * cap);
+    if (!c) return NULL;
+    node->child = c;
+    node->child_cap = cap;
+  }
+  drain_node_t *c = &node->child[node->nchild++];
+  memset(c, 0, sizeof(*c));
+  c->key = key;
+  return c;
+}
+
+static void drain_node_free(drain_node_t *node) {
+  for (size_t i = 0; i < node->nchild; i++) drain_node_free(&node->child[i]);
+  free(node->child);
+  free(node->cluster);
+}
+
+static void drain_free(drain_t *d) {
+  drain_node_free(&d->root);
+  for (size_t i = 0; i < d->n; i++) {
+    for (size_t k = 0; k < d->c[i].ntok; k++) free(d->c[i].tok[k]);
+    free(d->c[i].tok);
+    free(d->c[i].hash);
+  }
+  free(d->c);
+  memset(d, 0, sizeof(*d));
+}
+
+static size_t drain_tokenize(drain_t *d, const char *line) {
+  size_t n = 0;
+  const char *p = line;
+  while (n < DRAIN_MAX_TOKENS) {
+    while (*p && isspace((unsigned char)*p)) p++;
+    if (!*p) break;
+    const char *s = p;
+    while (*p && !isspace((unsigned char)*p)) p++;
+    d->tok[n] = s;
+    d->len[n] = (size_t)(p - s);
+    d->var[n] = token_is_variable(s, d->len[n]);
+    d->hash[n] = d->var[n] ? k_drain_wild : hash_bytes(s, d->len[n]);
+    n++;
+  }
+  return n;
+}
+
+// A parameter token matches a <*> position, like masked tokens do in Drain.
+static bool drain_token_eq(const drain_cluster_t *c, size_t i, const drain_t *d) {
+  if (!c->tok[i]) return d->var[i];
+  return c->hash[i] == d->hash[i] &&
+         strncmp(c->tok[i], d->tok[i], d->len[i]) == 0 && c->tok[i][d->len[i]] == '\0';
+}
+
+static drain_cluster_t *drain_new_cluster(drain_t *d, drain_node_t *leaf, size_t ntok) {
+  if (d->n >= DRAIN_MAX_CLUSTERS) return NULL;
+  if (d->n == d->cap) {
+    size_t cap = d->cap ? d->cap * 2 : 64;
+    drain_cluster_t *c = (drain_cluster_t *)realloc(d->c, sizeof(drain_cluster_t) * cap);
+    if (!c) return NULL;
+    d->c = c;
+    d->cap = cap;
+  }
+  if (leaf->ncluster == leaf->cluster_cap) {
+    size_t cap = leaf->cluster_cap ? leaf->cluster_cap * 2 : 4;
+    size_t *c = (size_t *)realloc(leaf->cluster, sizeof(size_t) * cap);
+    if (!c) return NULL;
+    leaf->cluster = c;
+    leaf->cluster_cap = cap;
+  }
+
+  drain_cluster_t *c = &d->c[d->n];
+  memset(c, 0, sizeof(*c));
+  c->tok = (char **)calloc(ntok ? ntok : 1, sizeof(char *));
+  c->hash = (uint64_t *)calloc(ntok ? ntok : 1, sizeof(uint64_t));
+  if (!c->tok || !c->hash) {
+    free(c->tok);
+    free(c->hash);
+    return NULL;
+  }
+  c->ntok = ntok;
+  for (size_t i = 0; i < ntok; i++) {
+    c->hash[i] = d->hash[i];
+    if (!d->var[i]) c->tok[i] = strndup_s(d->tok[i], d->len[i]);
+  }
+  c->id = (uint32_t)(d->n + 1);
+  leaf->cluster[leaf->ncluster++] = d->n;
+  d->n++;
+  return c;
+}
+
+// Adds a line. Returns its cluster (NULL if over the cluster cap); *is_new
+// tells whether the cluster was created for this line.
+static drain_cluster_t *drain_add(drain_t *d, const char *line, bool *is_new) {
+  *is_new = false;
+  d->lines++;
+  size_t ntok = drain_tokenize(d, line);
+
+  drain_node_t *node = drain_child(&d->root, (uint64_t)ntok, false);
+  for (size_t i = 0; node && i < DRAIN_DEPTH && i < ntok; i++) node = drain_child(node, d->hash[i], true);
+  if (!node) return NULL;
+
+  drain_cluster_t *best = NULL;
+  double best_sim = -1.0;
+  for (size_t k = 0; k < node->ncluster; k++) {
+    drain_cluster_t *c = &d->c[node->cluster[k]];
+    size_t same = 0;
+    for (size_t i = 0; i < ntok; i++) same += drain_token_eq(c, i, d);
+    double sim = ntok ? (double)same / (double)ntok : 1.0;
+    if (sim > best_sim) {
+      best_sim = sim;
+      best = c;
+    }
+  }
+
+  if (best && best_sim >= DRAIN_SIM) {
+    for (size_t i = 0; i < ntok; i++) {
+      if (best->tok[i] && !drain_token_eq(best, i, d)) {
+        free(best->tok[i]);
+        best->tok[i] = NULL;
+        best->hash[i] = k_drain_wild;
+      }
+    }
+    best->count++;
+    return best;
+  }
+
+  drain_cluster_t *c = drain_new_cluster(d, node, ntok);
+  if (!c) {
+    d->overflow++;
+    return NULL;
+  }
+  c->count = 1;
+  *is_new = true;
+  return c;
+}
+
+static void drain_print_template(FILE *out, const drain_cluster_t *c) {
+  for (size_t i = 0; i < c->ntok; i++) {
+    if (i) fputc(' ', out);
+    fputs(c->tok[i] ? c->tok[i] : "<*>", out);
+  }
+}
+
+static int drain_cmp_desc(const void *a, const void *b) {
+  const drain_cluster_t *x = *(const drain_cluster_t *const *)a;
+  const drain_cluster_t *y = *(const drain_cluster_t *const *)b;
+  if (x->count != y->count) return x->count < y->count ? 1 : -1;
+  return x->id < y->id ? -1 : 1;
+}
+
+static void drain_report(FILE *out, const drain_t *d, long top_n) {
+  fprintf(out, "templates: %llu lines, %zu templates", (unsigned long long)d->lines, d->n);
+  if (d->overflow) fprintf(out, " (%llu lines over the %d template cap)", (unsigned long long)d->overflow, DRAIN_MAX_CLUSTERS);
+  fputc('\n', out);
+
+  const drain_cluster_t **sorted = (const drain_cluster_t **)malloc(sizeof(*sorted) * (d->n ? d->n : 1));
+  if (!sorted) return;
+  for (size_t i = 0; i < d->n; i++) sorted[i] = &d->c[i];
+  qsort((void *)sorted, d->n, sizeof(*sorted), drain_cmp_desc);
+
+  size_t shown = (top_n > 0 && (size_t)top_n < d->n) ? (size_t)top_n : d->n;
+  for (size_t i = 0; i < shown; i++) {
+    fprintf(out, "%10llu  T%-5u ", (unsigned long long)sorted[i]->count, (unsigned)sorted[i]->id);
+    drain_print_template(out, sorted[i]);
+    fputc('\n', out);
+  }
+  free((void *)sorted);
+}
+
+// -------------------------
+// follow implementation
+// -------------------------
+
+static int64_t file_size(FILE *fp) {
+#ifdef _WIN32
+  int fd = _fileno(fp);
+  if (fd < 0) return -1;
+  __int64 cur = _telli64(fd);
+  __int64 end = _lseeki64(fd, 0, SEEK_END);
+  _lseeki64(fd, cur, SEEK_SET);
+  return (int64_t)end;
+#else
+  struct stat st;
+  if (fstat(fileno(fp), &st) != 0) return -1;
+  return (int64_t)st.st_size;
+#endif
+}
+
+// last modification, nanoseconds since the Unix epoch (0 if unknown)
+static int64_t file_mtime_ns(FILE *fp) {
+#ifdef _WIN32
+  FILETIME ft;
+  HANDLE h = (HANDLE)_get_osfhandle(_fileno(fp));
+  if (h == INVALID_HANDLE_VALUE || !GetFileTime(h, NULL, NULL, &ft)) return 0;
+  ULARGE_INTEGER u;
+  u.LowPart = ft.dwLowDateTime;
+  u.HighPart = ft.dwHighDateTime;
+  return ((int64_t)u.QuadPart - 116444736000000000LL) * 100;
+#else
+  struct stat st;
+  if (fstat(fileno(fp), &st) != 0) return 0;
+#if defined(__APPLE__)
+  return (int64_t)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+  return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+#endif
+}
+
+// device and inode (volume serial and file index on Windows)
+static bool file_identity(FILE *fp, uint64_t *dev, uint64_t *ino) {
+#ifdef _WIN32
+  BY_HANDLE_FILE_INFORMATION info;
+  HANDLE h = (HANDLE)_get_osfhandle(_fileno(fp));
+  if (h == INVALID_HANDLE_VALUE || !GetFileInformationByHandle(h, &info)) return false;
+  *dev = info.dwVolumeSerialNumber;
+  *ino = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+#else
+  struct stat st;
+  if (fstat(fileno(fp), &st) != 0) return false;
+  *dev = (uint64_t)st.st_dev;
+  *ino = (uint64_t)st.st_ino;
+#endif
+  return true;
+}
+
+// With hits != NULL every include is evaluated and hits[i] records which ones
+// matched (for per-rule counters); otherwise the first match wins.
+static bool should_print(const lk_rules *rules, const ruleset_t *includes, const ruleset_t *excludes,
+                         const char *line, size_t len, bool *hits) {
+  rule_eval_t e = {includes, excludes, hits, includes->timed ? now_ns() : 0};
+  return lk_rules_match_each(rules, line, len, hits != NULL, rule_evaluated, &e) != 0;
+}
+
+static int print_line(const opts_t *o, const char *line) {
+  if (o->json_mode && is_jsonish(line)) {
+    print_json_colorized(stdout, line, o->json_keys, o->json_key_count);
+  } else {
+    print_highlighted_plain(stdout, line, o->highlight, o->highlight_count);
+  }
+  fputc('\n', stdout);
+  return 0;
+}
+
+// -------------------------
+// stats
+// -------------------------
+// Plain counters owned by the pipeline, so nothing is shared or atomic. Read
+// and write time is measured per batch; filter and render time on every
+// STATS_TIME_EVERY-th line and scaled up, which keeps clock reads off most
+// lines.
+
+#define STATS_TIME_EVERY 16
+
+typedef struct {
+  uint64_t lines, bytes, batches;
+  uint64_t matched, sampled_out, filtered, printed;
+  int64_t start_ns;
+  int64_t read_ns, filter_ns, render_ns, write_ns;
+  int64_t next_dump;   // now_ms() deadline for --stats-every
+
+  // Follow latency, in microseconds: detect = new data found by a read minus
+  // the file's mtime (how late polling noticed the write); process = that
+  // read until the lines it produced were flushed, once per printed line.
+  hist_t *detect;
+  hist_t *process;
+
+  int64_t lag_bytes;       // file size minus read position, while following
+  int64_t lag_ms;          // wall clock minus the last line's timestamp (-1: unknown)
+  int64_t max_lag_bytes, max_lag_ms;
+  bool lagging;            // above a --lag-warn threshold
+  int64_t next_lag_warn;   // now_ms() when to repeat the warning
+  uint64_t reopens;        // the file shrank and was reread from the start
+  int64_t detect_ns;       // now_ns() of the read that found the current batch
+  uint64_t printed_before; // printed count at that read
+} stats_t;
+
+static void fmt_si(char *buf, size_t n, double v) {
+  if (v >= 1e9) snprintf(buf, n, "%.1fG", v / 1e9);
+  else if (v >= 1e6) snprintf(buf, n, "%.1fM", v / 1e6);
+  else if (v >= 1e3) snprintf(buf, n, "%.1fk", v / 1e3);
+  else snprintf(buf, n, "%.0f", v);
+}
+
+static void stats_rules(FILE *out, const char *what, const ruleset_t *rs) {
+  for (size_t i = 0; i < rs->count; i++) {
+    fprintf(out, "  %-8s %-24s evals %llu  hits %llu\n", what, rs->pat[i],
+            (unsigned long long)rs->st[i].evals, (unsigned long long)rs->st[i].hits);
+  }
+}
+
+static void stats_report(FILE *out, const stats_t *st, const ruleset_t *inc, const ruleset_t *exc) {
+  double secs = (double)(now_ns() - st->start_ns) / 1e9;
+  if (secs <= 0.0) secs = 1e-9;
+  char lines[32], lps[32], bytes[32], bps[32];
+  fmt_si(lines, sizeof(lines), (double)st->lines);
+  fmt_si(lps, sizeof(lps), (double)st->lines / secs);
+  fmt_si(bytes, sizeof(bytes), (double)st->bytes);
+  fmt_si(bps, sizeof(bps), (double)st->bytes / secs);
+
+  fprintf(out, "logknife stats: %.1fs  lines %s (%s/s)  bytes %sB (%sB/s)  batches %llu\n",
+          secs, lines, lps, bytes, bps, (unsigned long long)st->batches);
+  fprintf(out, "  matched %llu  dropped %llu (sampled out %llu, filtered %llu)  printed %llu\n",
+          (unsigned long long)st->matched, (unsigned long long)(st->sampled_out + st->filtered),
+          (unsigned long long)st->sampled_out, (unsigned long long)st->filtered,
+          (unsigned long long)st->printed);
+  fprintf(out, "  time: read %.3fs  filter ~%.3fs  render ~%.3fs  write %.3fs\n",
+          (double)st->read_ns / 1e9, (double)st->filter_ns / 1e9,
+          (double)st->render_ns / 1e9, (double)st->write_ns / 1e9);
+  if (st->detect && st->detect->total) {
+    fprintf(out, "  latency: detect p50 %.1fms p99 %.1fms max %.1fms  process p50 %.2fms p99 %.2fms max %.2fms  (%llu reads, %llu lines)\n",
+            (double)hist_quantile(st->detect, 0.50) / 1000.0,
+            (double)hist_quantile(st->detect, 0.99) / 1000.0,
+            (double)st->detect->max / 1000.0,
+            (double)hist_quantile(st->process, 0.50) / 1000.0,
+            (double)hist_quantile(st->process, 0.99) / 1000.0,
+            (double)st->process->max / 1000.0,
+            (unsigned long long)st->detect->total, (unsigned long long)st->process->total);
+  }
+  if (st->max_lag_bytes > 0 || st->max_lag_ms > 0) {
+    char cur[32], max[32];
+    fmt_si(cur, sizeof(cur), (double)st->lag_bytes);
+    fmt_si(max, sizeof(max), (double)st->max_lag_bytes);
+    fprintf(out, "  lag: %sB behind EOF (max %sB)", cur, max);
+    if (st->lag_ms >= 0) fprintf(out, "  %.1fs behind (max %.1fs)", (double)st->lag_ms / 1000.0, (double)st->max_lag_ms / 1000.0);
+    fputc('\n', out);
+  }
+  stats_rules(out, "include", inc);
+  stats_rules(out, "exclude", exc);
+  fflush(out);
+}
+
+// A follow read found new data; mtime_ns is the file's last write time.
+static void stats_detect(stats_t *st, int64_t mtime_ns) {
+  if (!st->detect) return;
+  st->detect_ns = now_ns();
+  st->printed_before = st->printed;
+  int64_t late = wall_ns() - mtime_ns;
+  if (mtime_ns > 0) hist_record(st->detect, late > 0 ? (uint64_t)late / 1000 : 0);
+}
+
+// The batch's output was flushed.
+static void stats_emitted(stats_t *st) {
+  if (!st->detect || !st->detect_ns) return;
+  uint64_t lines = st->printed - st->printed_before;
+  hist_record_n(st->process, (uint64_t)(now_ns() - st->detect_ns) / 1000, lines);
+  st->detect_ns = 0;
+}
+
+// -------------------------
+// lag
+// -------------------------
+// How far follow mode is behind, updated once per batch: bytes between the
+// read position and end of file, and the wall clock minus the timestamp of
+// the batch's last line. Caught up (no bytes behind) counts as 0 s even if
+// the file has been quiet for a while.
+
+// days since 1970-01-01 of a proleptic Gregorian date
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  int64_t era = (y >= 0 ? y : y - 399) / 400;
+  unsigned yoe = (unsigned)(y - era * 400);
+  unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (int64_t)doe - 719468;
+}
+
+static int digits(const char *s, int n) {
+  int v = 0;
+  for (int i = 0; i < n; i++) {
+    if (!isdigit((unsigned char)s[i])) return -1;
+    v = v * 10 + (s[i] - '0');
+  }
+  return v;
+}
+
+// First ISO 8601 timestamp in the line ("2024-05-01T12:00:00.123Z",
+// "2024-05-01 12:00:00,5 +02:00", ...) as ms since the epoch, or -1. Without
+// a zone it is taken as local time.
+static int64_t line_timestamp_ms(const char *s) {
+  for (const char *p = s; (p = strchr(p, '-')) != NULL; p++) {
+    if (p - s < 4) continue;
+    const char *t = p - 4;
+    int y = digits(t, 4), mo, d, h, mi, sec;
+    if (y < 0 || (mo = digits(t + 5, 2)) < 1 || mo > 12 || t[7] != '-' ||
+        (d = digits(t + 8, 2)) < 1 || d > 31 || (t[10] != 'T' && t[10] != ' ') ||
+        (h = digits(t + 11, 2)) < 0 || t[13] != ':' || (mi = digits(t + 14, 2)) < 0 ||
+        t[16] != ':' || (sec = digits(t + 17, 2)) < 0) {
+      continue;
+    }
+    const char *q = t + 19;
+    int ms = 0;
+    if (*q == '.' || *q == ',') {
+      int scale = 100;
+      for (q++; isdigit((unsigned char)*q); q++) {
+        ms += (*q - '0') * scale;
+        scale /= 10;
+      }
+    }
+    if (*q == ' ' && (q[1] == '+' || q[1] == '-' || q[1] == 'Z')) q++;
+    int64_t secs;
+    if (*q == 'Z' || ((*q == '+' || *q == '-') && digits(q + 1, 2) >= 0)) {
+      int off = 0;
+      if (*q != 'Z') {
+        int oh = digits(q + 1, 2);
+        int om = q[3] == ':' ? digits(q + 4, 2) : digits(q + 3, 2);
+        off = (oh * 60 + (om > 0 ? om : 0)) * (*q == '-' ? -1 : 1);
+      }
+      secs = days_from_civil(y, (unsigned)mo, (unsigned)d) * 86400 + h * 3600 + mi * 60 + sec - off * 60;
+    } else {
+      struct tm tm;
+      memset(&tm, 0, sizeof(tm));
+      tm.tm_year = y - 1900;
+      tm.tm_mon = mo - 1;
+      tm.tm_mday = d;
+      tm.tm_hour = h;
+      tm.tm_min = mi;
+      tm.tm_sec = sec;
+      tm.tm_isdst = -1;
+      time_t tt = mktime(&tm);
+      if (tt == (time_t)-1) return -1;
+      secs = (int64_t)tt;
+    }
+    return secs * 1000 + ms;
+  }
+  return -1;
+}
+
+#define LAG_WARN_REPEAT_MS 60000
+
+// bytes < 0: unknown; last_line may be NULL
+static void lag_update(stats_t *st, const opts_t *o, int64_t bytes, const char *last_line) {
+  if (bytes >= 0) st->lag_bytes = bytes;
+  int64_t ts = last_line ? line_timestamp_ms(last_line) : -1;
+  if (ts >= 0) {
+    int64_t behind = wall_ns() / 1000000 - ts;
+    st->lag_ms = (behind > 0 && st->lag_bytes > 0) ? behind : 0;
+  } else if (st->lag_bytes == 0 && st->lag_ms > 0) {
+    st->lag_ms = 0;
+  }
+  if (st->lag_bytes > st->max_lag_bytes) st->max_lag_bytes = st->lag_bytes;
+  if (st->lag_ms > st->max_lag_ms) st->max_lag_ms = st->lag_ms;
+
+  if (o->lag_warn_bytes <= 0 && o->lag_warn_seconds <= 0) return;
+  bool over = (o->lag_warn_bytes > 0 && st->lag_bytes > o->lag_warn_bytes) ||
+              (o->lag_warn_seconds > 0 && st->lag_ms > o->lag_warn_seconds * 1000);
+  int64_t now = now_ms();
+  if (over && (!st->lagging || now >= st->next_lag_warn)) {
+    char b[32];
+    fmt_si(b, sizeof(b), (double)st->lag_bytes);
+    fflush(stdout);
+    fprintf(stderr, "logknife: falling behind %s: %sB behind end of file", o->path, b);
+    if (st->lag_ms >= 0) fprintf(stderr, ", %.1fs behind", (double)st->lag_ms / 1000.0);
+    fputc('\n', stderr);
+    st->next_lag_warn = now + LAG_WARN_REPEAT_MS;
+  } else if (!over && st->lagging) {
+    fflush(stdout);
+    fprintf(stderr, "logknife: caught up on %s\n", o->path);
+  }
+  st->lagging = over;
+}
+
+// -------------------------
+// trace
+// -------------------------
+// --trace writes Chrome trace events (chrome://tracing, Perfetto). Per batch:
+// the read, the line loop and the flush; on one line in TRACE_EVERY also the
+// filter and render spans of that line. Spans go into a fixed ring and are
+// written out between batches once it is half full, and at exit; if a single
+// batch overruns the ring, the oldest spans are dropped and counted. The
+// pipeline is single-threaded, so there is one ring and one tid.
+
+#define TRACE_EVERY 64
+#define TRACE_RING 8192
+
+typedef struct {
+  const char *name;
+  const char *cat;
+  const char *arg_name;  // NULL for none
+  int64_t start_ns, end_ns;
+  int64_t arg;
+} trace_span_t;
+
+typedef struct {
+  FILE *out;
+  trace_span_t ring[TRACE_RING];
+  size_t head, count;
+  uint64_t dropped;
+  uint64_t tick;         // lines seen, for sampling
+  int64_t t0;
+  int64_t batch_ns;      // start of the current batch's line loop
+  uint64_t batch_lines;
+  bool wrote;            // an event precedes the next one (comma)
+} trace_t;
+
+static bool trace_open(trace_t *t, const char *path) {
+  memset(t, 0, sizeof(*t));
+  t->out = fopen(path, "w");
+  if (!t->out) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  t->t0 = now_ns();
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"logknife\"}},\n"
+        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"pipeline\"}}",
+        t->out);
+  t->wrote = true;
+  return true;
+}
+
+static void trace_span(trace_t *t, const char *name, const char *cat, int64_t start_ns, int64_t end_ns,
+                       const char *arg_name, int64_t arg) {
+  size_t slot = (t->head + t->count) % TRACE_RING;
+  if (t->count == TRACE_RING) {
+    t->head = (t->head + 1) % TRACE_RING;
+    t->dropped++;
+  } else {
+    t->count++;
+  }
+  trace_span_t *e = &t->ring[slot];
+  e->name = name;
+  e->cat = cat;
+  e->arg_name = arg_name;
+  e->start_ns = start_ns;
+  e->end_ns = end_ns;
+  e->arg = arg;
+}
+
+static void trace_flush(trace_t *t) {
+  for (; t->count > 0; t->count--, t->head = (t->head + 1) % TRACE_RING) {
+    const trace_span_t *e = &t->ring[t->head];
+    fprintf(t->out, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1",
+            t->wrote ? ",\n" : "", e->name, e->cat,
+            (double)(e->start_ns - t->t0) / 1000.0, (double)(e->end_ns - e->start_ns) / 1000.0);
+    if (e->arg_name) fprintf(t->out, ",\"args\":{\"%s\":%lld}", e->arg_name, (long long)e->arg);
+    fputc('}', t->out);
+    t->wrote = true;
+  }
+  t->head = 0;
+}
+
+static void trace_close(trace_t *t) {
+  if (!t->out) return;
+  trace_flush(t);
+  fputs("\n]}\n", t->out);
+  fclose(t->out);
+  t->out = NULL;
+  if (t->dropped) fprintf(stderr, "trace: %llu spans dropped (ring full within a batch)\n", (unsigned long long)t->dropped);
+}
+
+// -------------------------
+// metrics
+// -------------------------
+// Prometheus text format, for the node exporter textfile collector
+// (--metrics-file, rewritten via a temp file and rename so a scrape never
+// sees half a file) or scraped directly from a unix socket (--metrics-socket,
+// POSIX). The socket is polled between batches, so a scrape waits at most
+// one --interval; HTTP GETs get an HTTP response, anything else the bare text.
+// Nothing blocks the follow loop: a connection that has not said whether
+// it is HTTP yet stays pending until the next batch, for up to
+// METRICS_WAIT_MS, and is then answered with the bare text.
+
+#define METRICS_CLIENTS 16
+#define METRICS_WAIT_MS 100
+
+typedef struct {
+  int fd;
+  int64_t deadline;     // now_ms() after which it gets the bare text
+  char head[4];         // first bytes of its request
+  size_t got;
+} metrics_client_t;
+
+typedef struct {
+  char *buf;
+  size_t len, cap;
+  int64_t next_write;   // now_ms() deadline for rewriting --metrics-file
+  int listen_fd;        // -1 if no socket
+  metrics_client_t client[METRICS_CLIENTS];
+  size_t nclient;
+} metrics_t;
+
+static void mbuf_printf(metrics_t *m, const char *fmt, ...) {
+  va_list ap;
+  for (;;) {
+    size_t room = m->cap - m->len;
+    va_start(ap, fmt);
+    int n = vsnprintf(m->buf ? m->buf + m->len : NULL, room, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < room) {
+      m->len += (size_t)n;
+      return;
+    }
+    size_t cap = m->cap ? m->cap * 2 : 4096;
+    while (cap - m->len <= (size_t)n) cap *= 2;
+    char *b = (char *)realloc(m->buf, cap);
+    if (!b) return;
+    m->buf = b;
+    m->cap = cap;
+  }
+}
+
+// label value with \ " and newline escaped
+static void mbuf_label(metrics_t *m, const char *v) {
+  for (; *v; v++) {
+    if (*v == '\\') mbuf_printf(m, "\\\\");
+    else if (*v == '"') mbuf_printf(m, "\\\"");
+    else if (*v == '\n') mbuf_printf(m, "\\n");
+    else mbuf_printf(m, "%c", *v);
+  }
+}
+
+static void metrics_head(metrics_t *m, const char *name, const char *type, const char *help) {
+  mbuf_printf(m, "# HELP logknife_%s %s\n# TYPE logknife_%s %s\n", name, help, name, type);
+}
+
+static void metrics_value(metrics_t *m, const char *name, const char *file, uint64_t v) {
+  mbuf_printf(m, "logknife_%s{file=\"", name);
+  mbuf_label(m, file);
+  mbuf_printf(m, "\"} %llu\n", (unsigned long long)v);
+}
+
+static void metrics_rules(metrics_t *m, const char *file, const char *kind, const ruleset_t *rs, bool hits) {
+  for (size_t i = 0; i < rs->count; i++) {
+    mbuf_printf(m, "logknife_rule_%s_total{file=\"", hits ? "hits" : "evals");
+    mbuf_label(m, file);
+    mbuf_printf(m, "\",kind=\"%s\",pattern=\"", kind);
+    mbuf_label(m, rs->pat[i]);
+    mbuf_printf(m, "\"} %llu\n", (unsigned long long)(hits ? rs->st[i].hits : rs->st[i].evals));
+  }
+}
+
+static void metrics_render(metrics_t *m, const char *file, const stats_t *st,
+                           const ruleset_t *inc, const ruleset_t *exc) {
+  m->len = 0;
+  metrics_head(m, "lines_total", "counter", "Lines read.");
+  metrics_value(m, "lines_total", file, st->lines);
+  metrics_head(m, "bytes_total", "counter", "Bytes read.");
+  metrics_value(m, "bytes_total", file, st->bytes);
+  metrics_head(m, "matched_total", "counter", "Lines that passed --include/--exclude.");
+  metrics_value(m, "matched_total", file, st->matched);
+  metrics_head(m, "filtered_total", "counter", "Lines dropped by --include/--exclude.");
+  metrics_value(m, "filtered_total", file, st->filtered);
+  metrics_head(m, "sampled_out_total", "counter", "Lines dropped by --sample.");
+  metrics_value(m, "sampled_out_total", file, st->sampled_out);
+  metrics_head(m, "printed_total", "counter", "Lines printed.");
+  metrics_value(m, "printed_total", file, st->printed);
+  if (inc->count || exc->count) {
+    metrics_head(m, "rule_hits_total", "counter", "Lines matched by each pattern.");
+    metrics_rules(m, file, "include", inc, true);
+    metrics_rules(m, file, "exclude", exc, true);
+    metrics_head(m, "rule_evals_total", "counter", "Times each pattern was evaluated.");
+    metrics_rules(m, file, "include", inc, false);
+    metrics_rules(m, file, "exclude", exc, false);
+  }
+  metrics_head(m, "lag_bytes", "gauge", "Bytes between the read position and the end of the file.");
+  metrics_value(m, "lag_bytes", file, st->lag_bytes > 0 ? (uint64_t)st->lag_bytes : 0);
+  if (st->lag_ms >= 0) {
+    metrics_head(m, "lag_seconds", "gauge", "Wall clock minus the timestamp of the last line read (0 when caught up).");
+    mbuf_printf(m, "logknife_lag_seconds{file=\"");
+    mbuf_label(m, file);
+    mbuf_printf(m, "\"} %.3f\n", (double)st->lag_ms / 1000.0);
+  }
+  metrics_head(m, "reopens_total", "counter", "Times the file shrank (truncated or replaced) and was reread from the start.");
+  metrics_value(m, "reopens_total", file, st->reopens);
+}
+
+static bool metrics_write_file(const metrics_t *m, const char *path) {
+  return write_file_atomic(path, m->buf, m->len, false);
+}
+
+#ifndef _WIN32
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // SO_NOSIGPIPE is set on the connection instead
+#endif
+
+// a scraper hanging up must not SIGPIPE the follower
+static bool send_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t w = send(fd, buf, len, MSG_NOSIGNAL);
+    if (w <= 0) return false;
+    buf += w;
+    len -= (size_t)w;
+  }
+  return true;
+}
+
+static bool unix_addr(struct sockaddr_un *addr, const char *path, const char *what) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "%s path too long: %s\n", what, path);
+    return false;
+  }
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+// Removes the socket at path. Anything else there (a log file passed in
+// the wrong position, say) is left alone: false, with a message.
+static bool unix_unlink(const char *path, const char *what) {
+  struct stat st;
+  if (lstat(path, &st) != 0) return errno == ENOENT;
+  if (!S_ISSOCK(st.st_mode)) {
+    fprintf(stderr, "%s %s exists and is not a socket\n", what, path);
+    return false;
+  }
+  return unlink(path) == 0;
+}
+
+// Sockets never block the loop, and a --run command started by a trigger
+// must not inherit them (nor keep a socket path busy after we exit).
+static void fd_nonblock_cloexec(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+// Non-blocking listening socket at path; -1 on failure.
+static int unix_listen(const char *path, const char *what) {
+  struct sockaddr_un addr;
+  if (!unix_addr(&addr, path, what)) return -1;
+  if (!unix_unlink(path, what)) return -1;  // stale socket from a previous run
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  fd_nonblock_cloexec(fd);
+  return fd;
+}
+
+static bool metrics_listen(metrics_t *m, const char *path) {
+  m->listen_fd = unix_listen(path, "--metrics-socket");
+  return m->listen_fd >= 0;
+}
+
+// Reads what a client sent so far; true once it is ready for an answer.
+static bool metrics_client_ready(metrics_client_t *c, int64_t now) {
+  char req[4096];
+  ssize_t got;
+  while ((got = recv(c->fd, req, sizeof(req), MSG_DONTWAIT)) > 0) {
+    size_t n = (size_t)got < sizeof(c->head) - c->got ? (size_t)got : sizeof(c->head) - c->got;
+    memcpy(c->head + c->got, req, n);
+    c->got += n;
+  }
+  // an HTTP client sends its request first; a bare reader sends nothing
+  return c->got == sizeof(c->head) || got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK) ||
+         now >= c->deadline;
+}
+
+// Accepts new connections and answers the ones that are ready; `render` is
+// called once, if anyone is. Never waits.
+static void metrics_serve(metrics_t *m, void (*render)(void *), void *arg) {
+  int64_t now = now_ms();
+  while (m->nclient < METRICS_CLIENTS) {
+    int c = accept(m->listen_fd, NULL, NULL);
+    if (c < 0) break;
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(c, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    fd_nonblock_cloexec(c);
+    metrics_client_t *mc = &m->client[m->nclient++];
+    memset(mc, 0, sizeof(*mc));
+    mc->fd = c;
+    mc->deadline = now + METRICS_WAIT_MS;
+  }
+  bool rendered = false;
+  for (size_t i = 0; i < m->nclient;) {
+    metrics_client_t *c = &m->client[i];
+    if (!metrics_client_ready(c, now)) {
+      i++;
+      continue;
+    }
+    if (!rendered) {
+      render(arg);
+      rendered = true;
+    }
+    char head[128];
+    int hn = 0;
+    if (c->got == 4 && memcmp(c->head, "GET ", 4) == 0) {
+      hn = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", m->len);
+    }
+    // the snapshot fits the socket buffer; a client that will not take it is dropped
+    if (hn <= 0 || send_all(c->fd, head, (size_t)hn)) send_all(c->fd, m->buf, m->len);
+    close(c->fd);
+    *c = m->client[--m->nclient];
+  }
+}
+
+#endif
+
+// -------------------------
+// ring: printed lines into a shared-memory ring (--ring)
+// -------------------------
+// Layout and the consumer side are in include/logknife_ring.h. The writer
+// keeps its own copies of head, tail and seq and publishes one record per
+// printed line: claim the bytes (reserve), write them, publish (head). As
+// the claim overwrites old records, tail moves past them so new readers and
+// lapped ones know where the oldest intact record starts. A writer that
+// restarts on a ring of the same size carries on from where it stopped, so
+// attached consumers see no break; a ring of another size gets a new file.
+// POSIX only.
+
+#ifndef _WIN32
+
+#define RING_MIN (64 * 1024)
+
+typedef struct {
+  lk_ring_header *h;
+  unsigned char *data;
+  size_t map_len;
+  uint64_t capacity;
+  uint64_t head, tail, seq;   // the writer's copies of the shared counters
+} ring_t;
+
+static bool ring_open(ring_t *r, const char *path, int64_t size) {
+  memset(r, 0, sizeof(*r));
+  uint64_t cap = RING_MIN;
+  while (cap < (uint64_t)size) cap <<= 1;
+  size_t map_len = LK_RING_HEADER + (size_t)cap;
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  struct stat st;
+  uint64_t magic = 0;
+  if (fd >= 0 && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+                  (st.st_size != 0 && (pread(fd, &magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) ||
+                                       magic != LK_RING_MAGIC)))) {
+    // never overwrite or replace a file that is not a ring (a log passed by mistake)
+    fprintf(stderr, "--ring %s exists and is not a logknife ring\n", path);
+    close(fd);
+    return false;
+  }
+  if (fd >= 0 && st.st_size != 0 && st.st_size != (off_t)map_len) {
+    // consumers may have the old ring mapped; shrinking it under them would fault
+    close(fd);
+    unlink(path);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    st.st_size = 0;
+  }
+  if (fd < 0 || (st.st_size == 0 && ftruncate(fd, (off_t)map_len) != 0)) {
+    fprintf(stderr, "Failed to create ring %s: %s\n", path, strerror(errno));
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map ring %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  r->h = (lk_ring_header *)map;
+  r->data = (unsigned char *)map + LK_RING_HEADER;
+  r->map_len = map_len;
+  r->capacity = cap;
+  lk_ring_header *h = r->h;
+  if (h->magic == LK_RING_MAGIC && h->version == LK_RING_VERSION && h->header_size == LK_RING_HEADER &&
+      h->capacity == cap) {
+    r->head = atomic_load_explicit(&h->head, memory_order_relaxed);
+    r->tail = atomic_load_explicit(&h->tail, memory_order_relaxed);
+    r->seq = atomic_load_explicit(&h->seq, memory_order_relaxed);
+    return true;
+  }
+  h->magic = 0;
+  h->version = LK_RING_VERSION;
+  h->header_size = LK_RING_HEADER;
+  h->capacity = cap;
+  atomic_store_explicit(&h->head, 0, memory_order_relaxed);
+  atomic_store_explicit(&h->reserve, 0, memory_order_relaxed);
+  atomic_store_explicit(&h->tail, 0, memory_order_relaxed);
+  atomic_store_explicit(&h->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  h->magic = LK_RING_MAGIC;
+  return true;
+}
+
+static void ring_close(ring_t *r) {
+  if (r->h) munmap(r->h, r->map_len);
+  r->h = NULL;
+}
+
+static void ring_write_record(ring_t *r, uint64_t pos, uint32_t len, uint32_t flags, uint64_t seq) {
+  lk_ring_record rec;
+  rec.len = len;
+  rec.flags = flags;
+  rec.seq = seq;
+  memcpy(r->data + (pos & (r->capacity - 1)), &rec, sizeof(rec));
+}
+
+// Lines longer than a quarter of the ring are cut, so it always holds a few.
+static void ring_publish(ring_t *r, const char *line, size_t len) {
+  size_t max = (size_t)(r->capacity / 4) - sizeof(lk_ring_record);
+  if (len > max) len = max;
+  uint64_t need = LK_RING_SIZE(len);
+  uint64_t off = r->head & (r->capacity - 1);
+  uint64_t pad = off + need > r->capacity ? r->capacity - off : 0;
+  uint64_t end = r->head + pad + need;
+  while (r->tail + r->capacity < end) {
+    lk_ring_record old;
+    memcpy(&old, r->data + (r->tail & (r->capacity - 1)), sizeof(old));
+    r->tail += LK_RING_SIZE(old.len);
+  }
+  lk_ring_header *h = r->h;
+  atomic_store_explicit(&h->tail, r->tail, memory_order_relaxed);
+  atomic_store_explicit(&h->reserve, end, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);  // the claim is visible before the bytes change
+  if (pad) ring_write_record(r, r->head, (uint32_t)(pad - sizeof(lk_ring_record)), LK_RING_PAD, r->seq + 1);
+  ring_write_record(r, r->head + pad, (uint32_t)len, 0, ++r->seq);
+  memcpy(r->data + ((r->head + pad) & (r->capacity - 1)) + sizeof(lk_ring_record), line, len);
+  atomic_store_explicit(&h->seq, r->seq, memory_order_relaxed);
+  atomic_store_explicit(&h->head, end, memory_order_release);
+  r->head = end;
+}
+
+#endif
+
+// -------------------------
+// records: multi-line entries (--record-start)
+// -------------------------
+// A line matching --record-start begins a record; the lines after it that
+// do not (stack frames, "Caused by:", wrapped messages) are continuations,
+// and the whole record goes through the pipeline as one entry, its lines
+// joined by '\n'. Lines are appended to one arena that every record reuses,
+// so grouping costs a memcpy per line and, once the arena has grown, no
+// allocation. A record ends when the next one starts, at end of input, or
+// after RECORD_FLUSH_MS without a new line while following. Records are cut
+// into pieces of at most RECORD_MAX bytes.
+
+#define RECORD_FLUSH_MS 1000
+#define RECORD_MAX (1 << 20)
+
+typedef struct {
+  lk_re_t start;
+  char *buf;        // the open record, NUL-terminated
+  size_t len, cap;
+  size_t lines;     // in the open record; 0 = none
+  size_t held;      // input bytes behind it, newlines included
+  bool grew;        // lines added since the last batch
+  int64_t idle_since;
+} record_t;
+
+static bool record_append(record_t *r, const char *line, size_t len, size_t raw_len) {
+  size_t need = r->len + 1 + len + 1;
+  if (need > r->cap) {
+    size_t cap = r->cap ? r->cap : 4096;
+    while (cap < need) cap *= 2;
+    char *n = (char *)realloc(r->buf, cap);
+    if (!n) return false;
+    r->buf = n;
+    r->cap = cap;
+  }
+  if (r->lines) r->buf[r->len++] = '\n';
+  memcpy(r->buf + r->len, line, len);
+  r->len += len;
+  r->buf[r->len] = '\0';
+  r->lines++;
+  r->held += raw_len + 1;
+  r->grew = true;
+  return true;
+}
+
+static void record_reset(record_t *r) {
+  r->len = 0;
+  r->lines = 0;
+  r->held = 0;
+}
+
+static void record_free(record_t *r) {
+  lk_re_free(&r->start);
+  free(r->buf);
+}
+
+// -------------------------
+// pipeline: filter, then print or aggregate
+// -------------------------
+
+typedef struct {
+  const opts_t *o;
+  lk_rules *rules;      // --include / --exclude
+  ruleset_t includes;   // ... and their counters
+  ruleset_t excludes;
+  stats_t stats;
+
+  field_t count_field;
+  topk_t count_by;
+
+  field_t quant_field;
+  quant_t quant;
+
+  field_t distinct_field;
+  distinct_t distinct;
+
+  rates_t rates;
+  const char **rule_names;
+  bool *rule_hits;
+
+  trigger_t *triggers;
+
+  drain_t *drain;
+
+  norm_t norm;
+  field_t sample_field;
+  reservoir_t *reservoir;
+  field_t limit_field;
+  limiter_t limiter;
+  collapse_t collapse;
+  record_t record;      // --record-start
+  uint64_t profile_tick;  // lines seen by the filter, for --profile-patterns
+  trace_t *trace;
+  metrics_t metrics;
+#ifndef _WIN32
+  ring_t ring;          // --ring; ring.h is NULL without it
+#endif
+
+  bool windowed;        // some aggregator needs the clock per line
+  bool aggregating;     // lines feed reports instead of being printed
+  int64_t next_report;  // now_ms() deadline for the next periodic report
+} pipeline_t;
+
+// note_fn for the aggregators: into the ring with the lines, or to stdout
+static void pipeline_note(void *arg, const char *text) {
+#ifndef _WIN32
+  pipeline_t *p = (pipeline_t *)arg;
+  if (p->ring.h) {
+    ring_publish(&p->ring, text, strlen(text));
+    return;
+  }
+#else
+  (void)arg;
+#endif
+  emit_note(NULL, NULL, text);
+}
+
+static bool pipeline_init(pipeline_t *p, const opts_t *o) {
+  memset(p, 0, sizeof(*p));
+  p->o = o;
+
+  p->stats.start_ns = now_ns();
+  p->stats.lag_ms = -1;
+  char err[256];
+  p->rules = lk_rules_compile(o->include, o->include_count, o->exclude, o->exclude_count, err, sizeof(err));
+  if (!p->rules) {
+    fprintf(stderr, "%s\n", err);
+    return false;
+  }
+  if (!ruleset_init(&p->includes, o->include, o->include_count) ||
+      !ruleset_init(&p->excludes, o->exclude, o->exclude_count)) {
+    fprintf(stderr, "OOM\n");
+    return false;
+  }
+
+  if (o->count_by) {
+    if (!field_compile(&p->count_field, o->count_by)) {
+      fprintf(stderr, "Invalid --count-by field: %s\n", o->count_by);
+      return false;
+    }
+    topk_init(&p->count_by, (size_t)o->max_keys);
+    p->aggregating = true;
+  }
+
+  // windows are wall-clock based, so they only make sense while following
+  int64_t now = now_ms();
+  int64_t window_ms = o->follow ? (int64_t)o->window_seconds * 1000 : 0;
+
+  if (o->percentiles) {
+    if (!field_compile(&p->quant_field, o->percentiles)) {
+      fprintf(stderr, "Invalid --percentiles field: %s\n", o->percentiles);
+      return false;
+    }
+    if (!quant_init(&p->quant, window_ms, now)) {
+      fprintf(stderr, "OOM\n");
+      return false;
+    }
+    p->aggregating = true;
+  }
+
+  if (o->distinct) {
+    if (!field_compile(&p->distinct_field, o->distinct)) {
+      fprintf(stderr, "Invalid --distinct field: %s\n", o->distinct);
+      return false;
+    }
+    if (!distinct_init(&p->distinct, window_ms, now)) {
+      fprintf(stderr, "OOM\n");
+      return false;
+    }
+    p->aggregating = true;
+  }
+
+  if (o->rate_by_rule) {
+    static const char *all[] = { "(all lines)" };
+    size_t nrules = o->include_count ? o->include_count : 1;
+    p->rule_names = o->include_count ? o->include : all;
+    p->rule_hits = (bool *)calloc(nrules, sizeof(bool));
+    if (!p->rule_hits || !rates_init(&p->rates, nrules, window_ms, now)) {
+      fprintf(stderr, "OOM\n");
+      return false;
+    }
+    p->aggregating = true;
+  }
+
+  if (o->templates) {
+    p->drain = (drain_t *)calloc(1, sizeof(drain_t));
+    if (!p->drain) return false;
+    p->aggregating = true;
+  }
+
+  if (o->trigger_count) {
+    p->triggers = (trigger_t *)calloc(o->trigger_count, sizeof(trigger_t));
+    if (!p->triggers) return false;
+    for (size_t i = 0; i < o->trigger_count; i++) {
+      if (!trigger_init(&p->triggers[i], &o->triggers[i], now)) return false;
+    }
+  }
+
+  if (o->sample_key && !field_compile(&p->sample_field, o->sample_key)) {
+    fprintf(stderr, "Invalid --sample-key field: %s\n", o->sample_key);
+    return false;
+  }
+
+  if (o->reservoir > 0) {
+    int64_t every = (int64_t)(o->window_seconds > 0 ? o->window_seconds : o->every_seconds) * 1000;
+    p->reservoir = (reservoir_t *)calloc(1, sizeof(reservoir_t));
+    if (!p->reservoir || !reservoir_init(p->reservoir, (size_t)o->reservoir, every, now)) {
+      fprintf(stderr, "OOM\n");
+      return false;
+    }
+  }
+
+  if (o->limit_field) {
+    if (!field_compile(&p->limit_field, o->limit_field)) {
+      fprintf(stderr, "Invalid --limit-per field: %s\n", o->limit_field);
+      return false;
+    }
+    if (!limiter_init(&p->limiter, o->limit_field, o->limit_rate, now)) {
+      fprintf(stderr, "OOM\n");
+      return false;
+    }
+    p->limiter.note = pipeline_note;
+    p->limiter.note_arg = p;
+  }
+
+  p->collapse.note = pipeline_note;
+  p->collapse.note_arg = p;
+
+  if (o->record_start && !lk_re_compile(&p->record.start, o->record_start)) {
+    fprintf(stderr, "Failed to compile record-start pattern: %s\n", o->record_start);
+    return false;
+  }
+
+  p->windowed = window_ms > 0 || o->rate_by_rule || o->trigger_count > 0 || o->collapse || o->limit_field;
+  if (o->stats_every_seconds > 0) p->stats.next_dump = now + o->stats_every_seconds * 1000;
+  if (o->stats && o->follow) {
+    p->stats.detect = (hist_t *)calloc(1, sizeof(hist_t));
+    p->stats.process = (hist_t *)calloc(1, sizeof(hist_t));
+    if (!p->stats.detect || !p->stats.process) return false;
+  }
+  p->metrics.listen_fd = -1;
+  if (o->metrics_file) p->metrics.next_write = now;
+#ifndef _WIN32
+  if (o->metrics_socket && !metrics_listen(&p->metrics, o->metrics_socket)) return false;
+  if (o->ring_path && !ring_open(&p->ring, o->ring_path, o->ring_size)) return false;
+#endif
+  if (o->trace_path) {
+    p->trace = (trace_t *)malloc(sizeof(trace_t));
+    if (!p->trace) {
+      fprintf(stderr, "OOM\n");
+      return false;
+    }
+    if (!trace_open(p->trace, o->trace_path)) return false;
+  }
+  p->next_report = now + o->every_seconds * 1000;
+  return true;
+}
+
+// Fields come from the raw line; @line sees the normalized one.
+static bool pipeline_field(const field_t *f, const char *raw, const char *line, const char **v, size_t *n) {
+  return field_get(f, f->is_line ? line : raw, v, n);
+}
+
+static void pipeline_print(pipeline_t *p, const char *line) {
+  LK_PROBE1(render, strlen(line));
+#ifndef _WIN32
+  if (p->ring.h) {
+    ring_publish(&p->ring, line, strlen(line));
+    p->stats.printed++;
+    return;
+  }
+#endif
+  print_line(p->o, line);
+  p->stats.printed++;
+}
+
+// One line, or one record with --record-start.
+static void pipeline_entry(pipeline_t *p, char *raw) {
+  size_t raw_len = rstrip_newlines(raw);
+  LK_PROBE1(line_read, raw_len);
+  int64_t now = p->windowed ? now_ms() : 0;
+  p->stats.lines++;
+  bool timed = p->o->stats && p->stats.lines % STATS_TIME_EVERY == 0;
+  bool traced = p->trace && ++p->trace->tick % TRACE_EVERY == 0;
+  if (p->trace) p->trace->batch_lines++;
+  int64_t t0 = (timed || traced) ? now_ns() : 0;
+
+  for (size_t i = 0; i < p->o->trigger_count; i++) {
+    if (lk_re_match(&p->triggers[i].re, raw, raw_len)) rates_hit(&p->triggers[i].rate, 0, now);
+  }
+
+  if (p->o->sample > 0.0) {
+    const char *v = raw;
+    size_t n = 0;
+    if (!p->o->sample_key || !field_get(&p->sample_field, raw, &v, &n)) n = strlen(raw);
+    if (!sample_keep(hash_bytes(v, n), p->o->sample)) {
+      LK_PROBE2(filter, raw_len, 0);
+      p->stats.sampled_out++;
+      if (timed) p->stats.filter_ns += (now_ns() - t0) * STATS_TIME_EVERY;
+      return;
+    }
+  }
+
+  if (p->o->profile_patterns) {
+    p->includes.timed = p->excludes.timed = ++p->profile_tick % PROFILE_EVERY == 0;
+  }
+  bool *hits = (p->o->rate_by_rule && p->o->include_count) ? p->rule_hits : NULL;
+  bool ok = should_print(p->rules, &p->includes, &p->excludes, raw, raw_len, hits);
+  LK_PROBE2(filter, raw_len, ok);
+  if (timed || traced) {
+    int64_t t = now_ns();
+    if (timed) p->stats.filter_ns += (t - t0) * STATS_TIME_EVERY;
+    if (traced) trace_span(p->trace, "filter", "matcher", t0, t, "matched", ok);
+  }
+  if (!ok) {
+    p->stats.filtered++;
+    return;
+  }
+  p->stats.matched++;
+
+  const char *line = raw;
+  if (p->o->normalize) {
+    size_t len;
+    line = normalize_line(&p->norm, raw, &len);
+  }
+
+  if (p->o->rate_by_rule) {
+    if (!hits) rates_hit(&p->rates, 0, now);
+    for (size_t i = 0; hits && i < p->o->include_count; i++) {
+      if (hits[i]) rates_hit(&p->rates, i, now);
+    }
+  }
+
+  if (p->o->count_by) {
+    const char *v;
+    size_t n;
+    if (pipeline_field(&p->count_field, raw, line, &v, &n)) topk_add(&p->count_by, v, n);
+    else p->count_by.missing++;
+  }
+
+  if (p->o->percentiles) {
+    const char *v;
+    size_t n;
+    if (pipeline_field(&p->quant_field, raw, line, &v, &n)) quant_add(&p->quant, v, n, now);
+    else p->quant.invalid++;
+  }
+
+  if (p->o->distinct) {
+    const char *v;
+    size_t n;
+    if (pipeline_field(&p->distinct_field, raw, line, &v, &n)) distinct_add(&p->distinct, v, n, now);
+    else p->distinct.missing++;
+  }
+
+  if (p->drain) {
+    bool is_new = false;
+    drain_cluster_t *c = drain_add(p->drain, line, &is_new);
+    if (c && is_new && p->o->follow) {
+      printf("\x1b[33mnew\x1b[0m T%u ", (unsigned)c->id);
+      drain_print_template(stdout, c);
+      fputc('\n', stdout);
+    }
+  }
+
+  if (p->aggregating) return;
+  if (p->o->limit_field) {
+    const char *v;
+    size_t n;
+    if (pipeline_field(&p->limit_field, raw, line, &v, &n) && !limiter_allow(&p->limiter, v, n, now)) return;
+  }
+  if (p->o->collapse && !collapse_line(&p->collapse, line, p->o->collapse_mask, now)) return;
+  if (p->reservoir) {
+    reservoir_offer(p->reservoir, line);
+    return;
+  }
+  int64_t t1 = (timed || traced) ? now_ns() : 0;
+  pipeline_print(p, line);
+  if (timed || traced) {
+    int64_t t = now_ns();
+    if (timed) p->stats.render_ns += (t - t1) * STATS_TIME_EVERY;
+    if (traced) trace_span(p->trace, "render", "writer", t1, t, NULL, 0);
+  }
+}
+
+static void pipeline_flush_record(pipeline_t *p) {
+  record_t *r = &p->record;
+  if (!r->lines) return;
+  pipeline_entry(p, r->buf);
+  record_reset(r);
+}
+
+static void pipeline_line(pipeline_t *p, char *raw) {
+  if (!p->o->record_start) {
+    pipeline_entry(p, raw);
+    return;
+  }
+  record_t *r = &p->record;
+  size_t raw_len = strlen(raw), len = raw_len;
+  while (len > 0 && (raw[len - 1] == '\n' || raw[len - 1] == '\r')) raw[--len] = '\0';
+  if (r->lines && (r->len + 1 + len > RECORD_MAX || lk_re_match(&r->start, raw, len))) {
+    pipeline_flush_record(p);
+  }
+  if (!record_append(r, raw, len, raw_len)) {
+    pipeline_flush_record(p);
+    pipeline_entry(p, raw);
+  }
+}
+
+// Input bytes read but not yet through the pipeline (an open record).
+static size_t pipeline_held(const pipeline_t *p) {
+  return p->record.lines ? p->record.held : 0;
+}
+
+static void pipeline_emit_reservoir(pipeline_t *p) {
+  reservoir_t *r = p->reservoir;
+  size_t n = r->seen < r->size ? (size_t)r->seen : r->size;
+  qsort(r->slot, n, sizeof(reservoir_slot_t), reservoir_cmp_seq);
+  for (size_t i = 0; i < n; i++) pipeline_print(p, r->slot[i].line);
+  if (r->seen > n) {
+    char text[96];
+    snprintf(text, sizeof(text), "[sampled %zu of %llu lines]", n, (unsigned long long)r->seen);
+    pipeline_note(p, text);
+  }
+  r->seen = 0;
+}
+
+static void pipeline_render_metrics(void *arg) {
+  pipeline_t *p = (pipeline_t *)arg;
+  metrics_render(&p->metrics, p->o->path, &p->stats, &p->includes, &p->excludes);
+}
+
+static void pipeline_metrics(pipeline_t *p, int64_t now, bool final) {
+  if (p->o->metrics_file && (final || now >= p->metrics.next_write)) {
+    pipeline_render_metrics(p);
+    metrics_write_file(&p->metrics, p->o->metrics_file);
+    p->metrics.next_write = now + p->o->metrics_every_seconds * 1000;
+  }
+#ifndef _WIN32
+  if (p->metrics.listen_fd >= 0) metrics_serve(&p->metrics, pipeline_render_metrics, p);
+#endif
+}
+
+static void pipeline_report(pipeline_t *p, bool final) {
+  if (final && p->o->record_start) pipeline_flush_record(p);
+  if (final && p->o->collapse) collapse_flush(&p->collapse);
+  if (final && p->o->limit_field) limiter_summary(&p->limiter, now_ms());
+  if (final && p->reservoir) pipeline_emit_reservoir(p);
+  if (final && p->o->stats) {
+    fflush(stdout);
+    stats_report(stderr, &p->stats, &p->includes, &p->excludes);
+  }
+  if (final && p->o->profile_patterns) {
+    fflush(stdout);
+    profile_report(stderr, &p->includes, &p->excludes);
+  }
+  if (final) pipeline_metrics(p, now_ms(), true);
+  if (!p->aggregating) return;
+  // refresh in place on a terminal, append otherwise
+  if (!final && stdout_is_tty()) fputs("\x1b[H\x1b[2J", stdout);
+  int64_t now = now_ms();
+  if (p->o->count_by) topk_report(stdout, &p->count_by, p->o->count_by, p->o->top_n);
+  if (p->o->percentiles) quant_report(stdout, &p->quant, p->o->percentiles, now);
+  if (p->o->distinct) distinct_report(stdout, &p->distinct, p->o->distinct, now);
+  if (p->o->rate_by_rule) rates_report(stdout, &p->rates, p->rule_names, p->o->sparkline, now);
+  if (p->drain) drain_report(stdout, p->drain, p->o->top_n);
+  if (!final) fputc('\n', stdout);
+  fflush(stdout);
+}
+
+// Once per read batch: flush output, check triggers, periodic reports.
+static void pipeline_batch(pipeline_t *p) {
+  int64_t now = now_ms();
+  if (p->o->record_start && p->o->follow && p->record.lines) {
+    // a record whose last line came a while ago is as complete as it gets
+    if (p->record.grew) p->record.idle_since = now;
+    else if (now - p->record.idle_since >= RECORD_FLUSH_MS) pipeline_flush_record(p);
+    p->record.grew = false;
+  }
+  if (p->o->collapse && p->o->follow && p->collapse.pending &&
+      now - p->collapse.pending_since >= COLLAPSE_FLUSH_MS) {
+    collapse_flush(&p->collapse);
+  }
+  if (p->o->limit_field && now >= p->limiter.next_summary) limiter_summary(&p->limiter, now);
+  if (p->reservoir && p->o->follow && now >= p->reservoir->next_emit) {
+    pipeline_emit_reservoir(p);
+    p->reservoir->next_emit = now + p->reservoir->window_ms;
+  }
+  if (p->trace) {
+    trace_t *t = p->trace;
+    if (t->batch_lines) trace_span(t, "lines", "pipeline", t->batch_ns, now_ns(), "lines", (int64_t)t->batch_lines);
+    t->batch_lines = 0;
+  }
+  if (!p->aggregating) {
+    bool clock = p->o->stats || p->trace;
+    int64_t t0 = clock ? now_ns() : 0;
+    fflush(stdout);
+    LK_PROBE1(flush, p->stats.printed);
+    int64_t t1 = clock ? now_ns() : 0;
+    if (p->o->stats) p->stats.write_ns += t1 - t0;
+    if (p->trace) trace_span(p->trace, "flush", "writer", t0, t1, NULL, 0);
+    stats_emitted(&p->stats);
+  }
+  if (p->trace && p->trace->count >= TRACE_RING / 2) trace_flush(p->trace);
+  for (size_t i = 0; i < p->o->trigger_count; i++) trigger_eval(&p->triggers[i], now);
+  pipeline_metrics(p, now, false);
+
+  if (p->o->stats && (g_dump_stats || (p->stats.next_dump && now >= p->stats.next_dump))) {
+    g_dump_stats = 0;
+    stats_report(stderr, &p->stats, &p->includes, &p->excludes);
+    if (p->o->profile_patterns) profile_report(stderr, &p->includes, &p->excludes);
+    if (p->o->stats_every_seconds > 0) p->stats.next_dump = now + p->o->stats_every_seconds * 1000;
+  }
+
+  if (!p->aggregating || now < p->next_report) return;
+  pipeline_report(p, false);
+  p->next_report = now + p->o->every_seconds * 1000;
+}
+
+static void pipeline_free(pipeline_t *p) {
+  lk_rules_free(p->rules);
+  ruleset_free(&p->includes);
+  ruleset_free(&p->excludes);
+  free(p->stats.detect);
+  free(p->stats.process);
+  if (p->o->count_by) {
+    field_free(&p->count_field);
+    topk_free(&p->count_by);
+  }
+  if (p->o->percentiles) {
+    field_free(&p->quant_field);
+    quant_free(&p->quant);
+  }
+  if (p->o->distinct) {
+    field_free(&p->distinct_field);
+    distinct_free(&p->distinct);
+  }
+  if (p->o->rate_by_rule) {
+    rates_free(&p->rates);
+    free(p->rule_hits);
+  }
+  for (size_t i = 0; p->triggers && i < p->o->trigger_count; i++) trigger_free(&p->triggers[i]);
+  free(p->triggers);
+  norm_free(&p->norm);
+  if (p->o->sample_key) field_free(&p->sample_field);
+  if (p->reservoir) reservoir_free(p->reservoir);
+  free(p->reservoir);
+  if (p->o->limit_field) {
+    field_free(&p->limit_field);
+    limiter_free(&p->limiter);
+  }
+  collapse_free(&p->collapse);
+  if (p->o->record_start) record_free(&p->record);
+  if (p->drain) drain_free(p->drain);
+  free(p->drain);
+  if (p->trace) trace_close(p->trace);
+  free(p->trace);
+#ifndef _WIN32
+  for (size_t i = 0; i < p->metrics.nclient; i++) close(p->metrics.client[i].fd);
+  if (p->metrics.listen_fd >= 0) {
+    close(p->metrics.listen_fd);
+    unix_unlink(p->o->metrics_socket, "--metrics-socket");
+  }
+  ring_close(&p->ring);
+#endif
+  free(p->metrics.buf);
+}
+
+// -------------------------
+// follow / scan
+// -------------------------
+
+static int64_t fd_seek(FILE *fp, int64_t off, int whence) {
+#ifdef _WIN32
+  return (int64_t)_lseeki64(_fileno(fp), off, whence);
+#else
+  return (int64_t)lseek(fileno(fp), (off_t)off, whence);
+#endif
+}
+
+static long fd_read(FILE *fp, char *buf, size_t n) {
+#ifdef _WIN32
+  return (long)_read(_fileno(fp), buf, (unsigned)n);
+#else
+  return (long)read(fileno(fp), buf, n);
+#endif
+}
+
+// -------------------------
+// line reader
+// -------------------------
+// Reads large blocks straight from the descriptor (so a pipe never blocks
+// waiting for a full buffer) and hands out complete lines in place. A trailing
+// partial line stays buffered until its newline arrives. Each fill is one
+// batch: per-batch work (triggers, reports, flushing) runs between fills.
+
+#define READ_BLOCK 65536
+#define MAX_LINE (1 << 20)
+
+typedef struct checkpoint checkpoint_t;
+
+typedef struct {
+  FILE *fp;
+  char *buf;
+  size_t cap;
+  size_t start, end;  // unconsumed bytes are [start, end)
+  checkpoint_t *cp;   // --state-file: updated after each batch, else NULL
+} reader_t;
+
+static bool reader_init(reader_t *r, FILE *fp) {
+  memset(r, 0, sizeof(*r));
+  r->fp = fp;
+  r->cap = READ_BLOCK * 2;
+  r->buf = (char *)malloc(r->cap + 1);
+  return r->buf != NULL;
+}
+
+static void reader_free(reader_t *r) {
+  free(r->buf);
+}
+
+// drop buffered bytes, e.g. after seeking
+static void reader_reset(reader_t *r) {
+  r->start = r->end = 0;
+}
+
+// file offset of the next unconsumed byte (-1 if not seekable)
+static int64_t reader_offset(const reader_t *r) {
+  int64_t pos = fd_seek(r->fp, 0, SEEK_CUR);
+  return pos < 0 ? -1 : pos - (int64_t)(r->end - r->start);
+}
+
+// Returns bytes read, 0 at EOF (or error).
+static size_t reader_fill(reader_t *r) {
+  if (r->start > 0) {
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
+  if (r->cap - r->end < READ_BLOCK && r->cap < MAX_LINE + READ_BLOCK) {
+    size_t cap = r->cap * 2;
+    char *b = (char *)realloc(r->buf, cap + 1);
+    if (b) {
+      r->buf = b;
+      r->cap = cap;
+    }
+  }
+  if (r->end == r->cap) return 0;
+  long got;
+  do {
+    got = fd_read(r->fp, r->buf + r->end, r->cap - r->end);
+  } while (got < 0 && errno == EINTR && !g_stop);
+  if (got <= 0) return 0;
+  r->end += (size_t)got;
+  return (size_t)got;
+}
+
+// Next complete line, NUL-terminated in place over its newline. With eof
+// set, a final unterminated line is returned as well.
+static char *reader_next(reader_t *r, bool eof) {
+  if (r->start == r->end) return NULL;
+  char *line = r->buf + r->start;
+  size_t avail = r->end - r->start;
+  char *nl = (char *)memchr(line, '\n', avail);
+  if (nl) {
+    *nl = '\0';
+    r->start += (size_t)(nl - line) + 1;
+    return line;
+  }
+  if (eof || avail >= MAX_LINE) {
+    line[avail] = '\0';
+    r->start = r->end;
+    return line;
+  }
+  return NULL;
+}
+
+static size_t pipeline_fill(pipeline_t *p, reader_t *r) {
+  if (!p->o->stats && !p->trace) {
+    size_t got = reader_fill(r);
+    p->stats.bytes += got;
+    p->stats.batches++;
+    return got;
+  }
+  int64_t t0 = now_ns();
+  size_t got = reader_fill(r);
+  int64_t t1 = now_ns();
+  p->stats.read_ns += t1 - t0;
+  p->stats.bytes += got;
+  p->stats.batches++;
+  if (p->trace) {
+    if (got) trace_span(p->trace, "read", "reader", t0, t1, "bytes", (int64_t)got);
+    p->trace->batch_ns = t1;
+  }
+  return got;
+}
+
+static void checkpoint_batch(checkpoint_t *cp, const reader_t *r, const char *last, size_t held, bool force);
+
+static void read_to_eof(reader_t *r, pipeline_t *p) {
+  while (!g_stop) {
+    size_t got = pipeline_fill(p, r);
+    char *line, *last = NULL;
+    while ((line = reader_next(r, got == 0)) != NULL) {
+      pipeline_line(p, line);
+      last = line;
+    }
+    pipeline_batch(p);
+    if (r->cp) checkpoint_batch(r->cp, r, last, pipeline_held(p), false);
+    if (got == 0) break;
+  }
+}
+
+static int tail_last_lines(reader_t *r, long n, pipeline_t *p) {
+  if (n <= 0) return 0;
+
+  // Read backwards in blocks and count newlines.
+  const size_t block = 4096;
+  int64_t end = file_size(r->fp);
+  if (end < 0) return 0;
+
+  int64_t pos = end;
+  long found = 0;
+  char *buf = (char *)malloc(block);
+  if (!buf) return 0;
+
+  while (pos > 0 && found <= n) {
+    size_t to_read = block;
+    if (pos < (int64_t)block) to_read = (size_t)pos;
+    pos -= (int64_t)to_read;
+    fd_seek(r->fp, pos, SEEK_SET);
+    long got = fd_read(r->fp, buf, to_read);
+    for (size_t i = got > 0 ? (size_t)got : 0; i > 0; i--) {
+      if (buf[i - 1] == '\n') {
+        found++;
+        if (found > n) {
+          pos += (int64_t)i;
+          goto done;
+        }
+      }
+    }
+  }
+
+  pos = 0;
+
+ done:
+  free(buf);
+  fd_seek(r->fp, pos, SEEK_SET);
+  reader_reset(r);
+
+  // Now print from pos to end.
+  read_to_eof(r, p);
+
+  return 0;
+}
+
+// -------------------------
+// checkpoints (--state-file)
+// -------------------------
+// The read position survives restarts. The state file holds the file's
+// identity (device and inode), the offset of the next unread byte and a
+// hash of the line before it. It is rewritten atomically (temp file, fsync,
+// rename) after a batch's output was flushed, at most once a second, and
+// at exit. A crash repeats at most about a second of output; a clean stop
+// repeats nothing. On start the offset is used if that line still hashes
+// the same. If the file was rotated meanwhile, the old file is found by its
+// inode next to the new one (app.log.1, app.log-20240501, ...), its
+// remainder is read first, then the new file from the start.
+
+#define STATE_SAVE_MS 1000
+#define CHECKPOINT_TAIL 4096  // bytes of the line that are hashed, from its end
+
+struct checkpoint {
+  const char *path;     // --state-file
+  uint64_t dev, ino;    // file being read
+  int64_t offset;       // next unread byte
+  uint64_t hash;        // of the line ending at offset (its last len bytes) ...
+  size_t len;           // ... without the newline
+  int64_t hash_offset;  // the offset hash and len belong to
+  int64_t next_save;    // now_ms() deadline
+  uint64_t saved_ino;   // what the state file holds now
+  int64_t saved_offset; // -1: not written yet
+};
+
+static bool checkpoint_save(checkpoint_t *cp) {
+  char buf[256];
+  int n = snprintf(buf, sizeof(buf), "logknife-state 1\ndev %llu\nino %llu\noffset %lld\nlen %llu\nhash %016llx\n",
+                   (unsigned long long)cp->dev, (unsigned long long)cp->ino, (long long)cp->offset,
+                   (unsigned long long)cp->len, (unsigned long long)cp->hash);
+  if (n <= 0 || !write_file_atomic(cp->path, buf, (size_t)n, true)) return false;
+  cp->saved_ino = cp->ino;
+  cp->saved_offset = cp->offset;
+  return true;
+}
+
+static bool checkpoint_load(checkpoint_t *cp) {
+  FILE *fp = fopen(cp->path, "r");
+  if (!fp) return false;
+  int version = 0;
+  unsigned long long dev, ino, len, hash;
+  long long offset;
+  int got = fscanf(fp, "logknife-state %d dev %llu ino %llu offset %lld len %llu hash %llx",
+                   &version, &dev, &ino, &offset, &len, &hash);
+  fclose(fp);
+  if (got != 6 || version != 1 || offset < 0 || len > CHECKPOINT_TAIL) {
+    fprintf(stderr, "Ignoring unreadable state file %s\n", cp->path);
+    return false;
+  }
+  cp->dev = dev;
+  cp->ino = ino;
+  cp->offset = offset;
+  cp->hash_offset = offset;
+  cp->len = (size_t)len;
+  cp->hash = hash;
+  return true;
+}
+
+// Reads the line ending at offset (without its newline), at most
+// CHECKPOINT_TAIL bytes of it, into buf; returns its length or -1.
+static long line_before(FILE *fp, int64_t offset, char *buf) {
+  int64_t start = offset - CHECKPOINT_TAIL - 2;  // room for \r\n
+  if (start < 0) start = 0;
+  size_t n = (size_t)(offset - start), have = 0;
+  long got;
+  if (fd_seek(fp, start, SEEK_SET) != start) return -1;
+  while (have < n && (got = fd_read(fp, buf + have, n - have)) > 0) have += (size_t)got;
+  if (have < n) return -1;
+  // the same trimming as the line got when it was read
+  while (have > 0 && (buf[have - 1] == '\n' || buf[have - 1] == '\r')) have--;
+  size_t from = have;
+  while (from > 0 && buf[from - 1] != '\n') from--;
+  memmove(buf, buf + from, have - from);
+  return (long)(have - from);
+}
+
+// Whether the line before the checkpoint's offset is still the one it hashed.
+static bool checkpoint_matches(FILE *fp, const checkpoint_t *cp) {
+  if (cp->offset == 0) return true;
+  if (file_size(fp) < cp->offset) return false;
+  char *buf = (char *)malloc(CHECKPOINT_TAIL + 2);
+  long n = buf ? line_before(fp, cp->offset, buf) : -1;
+  bool ok = n >= (long)cp->len && hash_bytes(buf + n - (long)cp->len, cp->len) == cp->hash;
+  free(buf);
+  return ok;
+}
+
+// Checkpoints the end of fp, e.g. when following starts there; leaves fp
+// positioned at it.
+static void checkpoint_mark_end(checkpoint_t *cp, FILE *fp) {
+  int64_t end = file_size(fp);
+  char *buf = (char *)malloc(CHECKPOINT_TAIL + 2);
+  long n = buf && end > 0 ? line_before(fp, end, buf) : -1;
+  cp->offset = end < 0 ? 0 : end;
+  cp->len = n > 0 ? (size_t)n : 0;
+  cp->hash = hash_bytes(buf ? buf : "", cp->len);
+  cp->hash_offset = cp->offset;
+  free(buf);
+  fd_seek(fp, cp->offset, SEEK_SET);
+}
+
+// After a batch was flushed; last is its last line, NULL if it had none.
+// held is how many bytes before the read position the pipeline has not
+// output yet (an open --record-start record); the checkpoint stays before them.
+static void checkpoint_batch(checkpoint_t *cp, const reader_t *r, const char *last, size_t held, bool force) {
+  int64_t off = reader_offset(r);
+  if (off < 0) return;
+  if (last && !held) {
+    size_t n = strlen(last);
+    cp->len = n < CHECKPOINT_TAIL ? n : CHECKPOINT_TAIL;
+    cp->hash = hash_bytes(last + n - cp->len, cp->len);
+    cp->hash_offset = off;
+  }
+  off -= (int64_t)held;
+  if (off < 0) off = 0;
+  cp->offset = off;
+  if (cp->offset == cp->saved_offset && cp->ino == cp->saved_ino) return;
+  int64_t now = now_ms();
+  if (!force && now < cp->next_save) return;
+  cp->next_save = now + STATE_SAVE_MS;
+  if (cp->hash_offset != off) {
+    // the line before off was not the last one read: hash it from the file
+    char *buf = (char *)malloc(CHECKPOINT_TAIL + 2);
+    int64_t pos = fd_seek(r->fp, 0, SEEK_CUR);
+    long n = buf ? line_before(r->fp, off, buf) : -1;
+    fd_seek(r->fp, pos, SEEK_SET);
+    if (n >= 0) {
+      cp->len = (size_t)n;
+      cp->hash = hash_bytes(buf, cp->len);
+      cp->hash_offset = off;
+    }
+    free(buf);
+    if (n < 0) return;
+  }
+  checkpoint_save(cp);
+}
+
+#ifndef _WIN32
+// Where rotation moved the file: a file next to path, named like it, with
+// the checkpoint's inode.
+static char *find_rotated(const char *path, uint64_t dev, uint64_t ino) {
+  const char *slash = strrchr(path, '/');
+  const char *base = slash ? slash + 1 : path;
+  char *dir = slash ? strndup_s(path, slash == path ? 1 : (size_t)(slash - path)) : strndup_s(".", 1);
+  DIR *d = dir ? opendir(dir) : NULL;
+  char *found = NULL;
+  struct dirent *e;
+  while (d && !found && (e = readdir(d)) != NULL) {
+    if (strncmp(e->d_name, base, strlen(base)) != 0 || strcmp(e->d_name, base) == 0) continue;
+    size_t n = strlen(dir) + strlen(e->d_name) + 2;
+    char *cand = (char *)malloc(n);
+    struct stat st;
+    if (cand) snprintf(cand, n, "%s/%s", dir, e->d_name);
+    if (cand && stat(cand, &st) == 0 && (uint64_t)st.st_dev == dev && (uint64_t)st.st_ino == ino) {
+      found = cand;
+    } else {
+      free(cand);
+    }
+  }
+  if (d) closedir(d);
+  free(dir);
+  return found;
+}
+#endif
+
+// Positions r at the saved position, reading what is left of a rotated
+// file first. False if there is no usable state file (r is untouched).
+static bool checkpoint_resume(checkpoint_t *cp, const char *path, reader_t *r, pipeline_t *p) {
+  checkpoint_t saved = *cp;
+  if (!checkpoint_load(&saved)) return false;
+  uint64_t dev, ino;
+  if (!file_identity(r->fp, &dev, &ino)) return false;
+  if (saved.dev == dev && saved.ino == ino) {
+    if (checkpoint_matches(r->fp, &saved)) {
+      *cp = saved;
+    } else {
+      fprintf(stderr, "%s no longer matches %s; reading it from the start\n", path, cp->path);
+      cp->dev = dev;
+      cp->ino = ino;
+      cp->offset = 0;
+    }
+    fd_seek(r->fp, cp->offset, SEEK_SET);
+    reader_reset(r);
+    return true;
+  }
+
+#ifndef _WIN32
+  char *old = find_rotated(path, saved.dev, saved.ino);
+  FILE *ofp = old ? fopen(old, "rb") : NULL;
+  reader_t orr;
+  if (ofp && checkpoint_matches(ofp, &saved) && reader_init(&orr, ofp)) {
+    // checkpointed as it goes, so a crash in here resumes in here
+    *cp = saved;
+    orr.cp = cp;
+    fd_seek(ofp, cp->offset, SEEK_SET);
+    read_to_eof(&orr, p);
+    reader_free(&orr);
+  } else {
+    fprintf(stderr, "%s was rotated and %s; lines written to it after the last checkpoint are skipped\n",
+            path, ofp ? "the old file no longer matches" : "the old file was not found next to it");
+  }
+  if (ofp) fclose(ofp);
+  free(old);
+#else
+  fprintf(stderr, "%s was rotated; reading the new file from the start\n", path);
+#endif
+  cp->dev = dev;
+  cp->ino = ino;
+  cp->offset = 0;
+  cp->len = 0;
+  cp->hash = hash_bytes("", 0);
+  fd_seek(r->fp, 0, SEEK_SET);
+  reader_reset(r);
+  return true;
+}
+
+static int cmd_follow(const opts_t *o) {
+  bool is_stdin = strcmp(o->path, "-") == 0;
+  if (is_stdin && o->state_file) {
+    fprintf(stderr, "--state-file needs a file, not stdin\n");
+    return 1;
+  }
+  FILE *fp = is_stdin ? stdin : fopen(o->path, "rb");
+  if (!fp) {
+    fprintf(stderr, "Failed to open %s: %s\n", o->path, strerror(errno));
+    return 1;
+  }
+#ifndef _WIN32
+  if (!is_stdin) fcntl(fileno(fp), F_SETFD, FD_CLOEXEC);  // --run commands must not hold the log open
+#endif
+
+  pipeline_t p;
+  if (!pipeline_init(&p, o)) return 1;
+
+  reader_t r;
+  if (!reader_init(&r, fp)) {
+    fprintf(stderr, "OOM\n");
+    return 1;
+  }
+
+  on_signal(SIGINT, on_sigint);
+#ifdef SIGTERM
+  on_signal(SIGTERM, on_sigint);  // a clean stop saves the position
+#endif
+#ifdef SIGUSR1
+  if (o->stats) on_signal(SIGUSR1, on_sigusr1);
+#endif
+
+  checkpoint_t cp;
+  memset(&cp, 0, sizeof(cp));
+  cp.path = o->state_file;
+  cp.saved_offset = -1;
+  bool resumed = false;
+  if (o->state_file) {
+    resumed = checkpoint_resume(&cp, o->path, &r, &p);
+    if (!resumed) file_identity(fp, &cp.dev, &cp.ino);
+    r.cp = &cp;
+  }
+
+  // determine tail behavior
+  long tail = o->tail_lines;
+  if (tail <= 0 && o->since_seconds > 0) {
+    tail = (long)(o->since_seconds * o->since_rate_lps);
+    if (tail < 1) tail = 1;
+    if (tail > 100000) tail = 100000;
+  }
+
+  if (resumed) {
+    // everything after the saved position, in both modes
+    if (!o->follow) read_to_eof(&r, &p);
+  } else if (tail > 0 && !is_stdin) {
+    tail_last_lines(&r, tail, &p);
+  } else if (!o->follow) {
+    read_to_eof(&r, &p);
+  }
+
+  if (o->follow) {
+    if (!resumed) {
+      // Start following from end
+      if (r.cp) {
+        checkpoint_mark_end(r.cp, fp);
+      } else {
+        fd_seek(fp, 0, SEEK_END);
+      }
+      reader_reset(&r);
+    }
+    int64_t last_size = file_size(fp);
+    bool track_lag = !is_stdin && (o->metrics_file || o->metrics_socket || o->stats ||
+                                   o->lag_warn_bytes > 0 || o->lag_warn_seconds > 0);
+
+    while (!g_stop) {
+      size_t got = pipeline_fill(&p, &r);
+      if (got > 0 && p.stats.detect) stats_detect(&p.stats, file_mtime_ns(fp));
+      char *line, *last = NULL;
+      while ((line = reader_next(&r, false)) != NULL) {
+        pipeline_line(&p, line);
+        last = line;
+      }
+      if (track_lag) {
+        int64_t off = reader_offset(&r);
+        lag_update(&p.stats, o, off >= 0 ? file_size(fp) - off : -1, last);
+      }
+      pipeline_batch(&p);
+      if (r.cp) checkpoint_batch(r.cp, &r, last, pipeline_held(&p), false);
+      if (got > 0) continue;
+
+      // truncation
+      int64_t sz = file_size(fp);
+      if (sz >= 0 && last_size >= 0 && sz < last_size) {
+        fd_seek(fp, 0, SEEK_SET);
+        reader_reset(&r);
+        p.stats.reopens++;
+      }
+      last_size = sz;
+
+      sleep_ms(o->interval_ms);
+    }
+  }
+
+  pipeline_report(&p, true);
+  if (r.cp) {
+    fflush(stdout);
+    checkpoint_batch(r.cp, &r, NULL, pipeline_held(&p), true);
+  }
+  pipeline_free(&p);
+  reader_free(&r);
+  if (!is_stdin) fclose(fp);
+  return 0;
+}
+
+// -------------------------
+// bench
+// -------------------------
+// `logknife bench` generates synthetic logs in memory from a fixed seed and
+// times each stage on its own: newline split (the follow reader over a temp
+// file), filtering per regex engine, highlighting and JSON rendering into a
+// null sink. The same options give byte-identical input, and each stage
+// reports its best of --runs to keep the numbers stable.
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+typedef enum { BENCH_PLAIN, BENCH_JSON, BENCH_LOGFMT } bench_format_t;
+
+static const char *const k_bench_formats[] = {"plain", "json", "logfmt"};
+
+typedef struct {
+  long lines;
+  long line_len;
+  double match_rate;
+  uint64_t seed;
+  long runs;
+  int format;           // -1 = all
+  const char *pattern;
+} bench_opts_t;
+
+typedef struct {
+  char *text;           // newline-separated corpus
+  size_t len;
+  char **lines;         // NUL-terminated copies of each line
+  size_t *lens;
+  char *store;
+  long count;
+} bench_corpus_t;
+
+static const char *const k_bench_words[] = {
+  "request", "completed", "user", "session", "cache", "miss", "upstream", "connection",
+  "retry", "timeout", "queue", "worker", "handler", "payload", "accepted", "closed",
+};
+
+static const char *const k_bench_levels[] = {"INFO", "DEBUG", "WARN", "INFO"};
+
+static bool bench_generate(bench_corpus_t *c, bench_format_t fmt, const bench_opts_t *b) {
+  memset(c, 0, sizeof(*c));
+  size_t cap = (size_t)b->lines * (size_t)(b->line_len + 64);
+  c->text = (char *)malloc(cap + 1);
+  c->store = (char *)malloc(cap + 1);
+  c->lines = (char **)malloc((size_t)b->lines * sizeof(char *));
+  c->lens = (size_t *)malloc((size_t)b->lines * sizeof(size_t));
+  if (!c->text || !c->store || !c->lines || !c->lens) return false;
+
+  uint64_t rng = b->seed * 0x9e3779b97f4a7c15ULL + 1;
+  uint64_t threshold = (uint64_t)(b->match_rate * 1000000.0);
+  char msg[4096];
+  size_t pos = 0, spos = 0;
+  for (long i = 0; i < b->lines; i++) {
+    uint64_t r = xorshift64(&rng);
+    const char *level = (r % 1000000 < threshold) ? "ERROR" : k_bench_levels[(r >> 20) & 3];
+    long ms = i * 7;
+    unsigned user = (unsigned)(xorshift64(&rng) % 100000);
+    double latency = (double)(xorshift64(&rng) % 100000) / 100.0;
+
+    // pad the message with words up to the target line length
+    size_t mlen = 0;
+    long room = b->line_len - 90;
+    if (room < 8) room = 8;
+    if (room > (long)sizeof(msg) - 32) room = (long)sizeof(msg) - 32;
+    while ((long)mlen < room) {
+      const char *w = k_bench_words[xorshift64(&rng) % (sizeof(k_bench_words) / sizeof(k_bench_words[0]))];
+      if (mlen) msg[mlen++] = ' ';
+      size_t wl = strlen(w);
+      memcpy(msg + mlen, w, wl);
+      mlen += wl;
+    }
+    msg[mlen] = '\0';
+
+    char *line = c->text + pos;
+    int n;
+    if (fmt == BENCH_JSON) {
+      n = snprintf(line, cap - pos, "{\"ts\":\"2024-05-01T12:%02ld:%02ld.%03ldZ\",\"level\":\"%s\",\"user\":%u,\"latency_ms\":%.2f,\"ok\":%s,\"msg\":\"%s\"}",
+                   (ms / 60000) % 60, (ms / 1000) % 60, ms % 1000, level, user, latency,
+                   (r & 1) ? "true" : "false", msg);
+    } else if (fmt == BENCH_LOGFMT) {
+      n = snprintf(line, cap - pos, "ts=2024-05-01T12:%02ld:%02ld.%03ldZ level=%s user=%u latency_ms=%.2f msg=\"%s\"",
+                   (ms / 60000) % 60, (ms / 1000) % 60, ms % 1000, level, user, latency, msg);
+    } else {
+      n = snprintf(line, cap - pos, "2024-05-01 12:%02ld:%02ld.%03ld %-5s [worker-%u] user=%u took %.2fms %s",
+                   (ms / 60000) % 60, (ms / 1000) % 60, ms % 1000, level, (unsigned)(r >> 40) % 16, user, latency, msg);
+    }
+    if (n < 0 || (size_t)n >= cap - pos) return false;
+    memcpy(c->store + spos, line, (size_t)n + 1);
+    c->lines[i] = c->store + spos;
+    c->lens[i] = (size_t)n;
+    spos += (size_t)n + 1;
+    pos += (size_t)n;
+    c->text[pos++] = '\n';
+  }
+  c->text[pos] = '\0';
+  c->len = pos;
+  c->count = b->lines;
+  return true;
+}
+
+static void bench_corpus_free(bench_corpus_t *c) {
+  free(c->text);
+  free(c->store);
+  free(c->lines);
+  free(c->lens);
+}
+
+static void bench_row(const char *fmt, const char *stage, int64_t ns, const bench_corpus_t *c, uint64_t check) {
+  double sec = (double)ns / 1e9;
+  if (sec <= 0.0) sec = 1e-9;
+  printf("%-7s %-16s %12.0f %9.1f %8.1f %10llu\n", fmt, stage,
+         (double)c->count / sec, (double)c->len / sec / 1e6, (double)ns / (double)c->count,
+         (unsigned long long)check);
+}
+
+// newline split through the follow reader; check = lines seen
+static int64_t bench_split(FILE *tmp, uint64_t *check) {
+  fd_seek(tmp, 0, SEEK_SET);
+  reader_t r;
+  if (!reader_init(&r, tmp)) return -1;
+  int64_t t0 = now_ns();
+  uint64_t n = 0;
+  for (;;) {
+    size_t got = reader_fill(&r);
+    while (reader_next(&r, got == 0) != NULL) n++;
+    if (got == 0) break;
+  }
+  int64_t dt = now_ns() - t0;
+  reader_free(&r);
+  *check = n;
+  return dt;
+}
+
+static int64_t bench_filter_builtin(const bench_corpus_t *c, const char *pat, uint64_t *check) {
+  int64_t t0 = now_ns();
+  uint64_t n = 0;
+  for (long i = 0; i < c->count; i++) n += lk_matchre_builtin(pat, c->lines[i], c->lens[i]) != 0;
+  *check = n;
+  return now_ns() - t0;
+}
+
+static int64_t bench_filter_re(const bench_corpus_t *c, const lk_re_t *re, uint64_t *check) {
+  int64_t t0 = now_ns();
+  uint64_t n = 0;
+  for (long i = 0; i < c->count; i++) n += lk_re_match(re, c->lines[i], c->lens[i]);
+  *check = n;
+  return now_ns() - t0;
+}
+
+static int64_t bench_render(const bench_corpus_t *c, FILE *sink, bool json, uint64_t *check) {
+  static const char *words[] = {"ERROR", "WARN"};
+  static const char *keys[] = {"level"};
+  int64_t t0 = now_ns();
+  for (long i = 0; i < c->count; i++) {
+    if (json) print_json_colorized(sink, c->lines[i], keys, 1);
+    else print_highlighted_plain(sink, c->lines[i], words, 2);
+    fputc('\n', sink);
+  }
+  fflush(sink);
+  int64_t dt = now_ns() - t0;
+  *check = (uint64_t)c->count;
+  return dt;
+}
+
+static int parse_bench_args(int argc, char **argv, bench_opts_t *b) {
+  memset(b, 0, sizeof(*b));
+  b->lines = 200000;
+  b->line_len = 160;
+  b->match_rate = 0.1;
+  b->seed = 1;
+  b->runs = 5;
+  b->format = -1;
+  b->pattern = "ERROR";
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--lines") == 0 && i + 1 < argc) {
+      b->lines = strtol(argv[++i], NULL, 10);
+      if (b->lines <= 0 || b->lines > 100000000) {
+        fprintf(stderr, "Invalid --lines\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--line-len") == 0 && i + 1 < argc) {
+      b->line_len = strtol(argv[++i], NULL, 10);
+      if (b->line_len < 64 || b->line_len > 4000) {
+        fprintf(stderr, "Invalid --line-len (64..4000)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--match-rate") == 0 && i + 1 < argc) {
+      b->match_rate = parse_fraction(argv[++i]);
+      if (b->match_rate <= 0.0) {
+        fprintf(stderr, "Invalid --match-rate (use 10%% or 0.1)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      const char *f = argv[++i];
+      b->format = -2;
+      for (int k = 0; k < 3; k++) {
+        if (strcmp(f, k_bench_formats[k]) == 0) b->format = k;
+      }
+      if (strcmp(f, "all") == 0) b->format = -1;
+      if (b->format == -2) {
+        fprintf(stderr, "Invalid --format (plain, json, logfmt or all)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--include") == 0 && i + 1 < argc) {
+      b->pattern = argv[++i];
+    } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+      b->runs = strtol(argv[++i], NULL, 10);
+      if (b->runs < 1) b->runs = 1;
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      b->seed = strtoull(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, "Unknown or incomplete arg: %s\n", argv[i]);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int cmd_bench_follow(int argc, char **argv);
+
+static int cmd_bench(int argc, char **argv) {
+  if (argc >= 3 && strcmp(argv[2], "follow") == 0) return cmd_bench_follow(argc, argv);
+
+  bench_opts_t b;
+  if (!parse_bench_args(argc, argv, &b)) {
+    usage(stderr);
+    return 2;
+  }
+
+  lk_re_t re;
+  memset(&re, 0, sizeof(re));
+  if (!lk_re_compile(&re, b.pattern)) {
+    fprintf(stderr, "Invalid --include pattern: %s\n", b.pattern);
+    return 2;
+  }
+  FILE *sink = fopen(NULL_DEVICE, "wb");
+  if (!sink) {
+    fprintf(stderr, "Failed to open %s\n", NULL_DEVICE);
+    lk_re_free(&re);
+    return 1;
+  }
+  static char sinkbuf[1 << 16];
+  setvbuf(sink, sinkbuf, _IOFBF, sizeof(sinkbuf));
+
+  printf("logknife bench: %ld lines/format, ~%ld B/line, match rate %.1f%%, pattern \"%s\", seed %llu, best of %ld\n",
+         b.lines, b.line_len, b.match_rate * 100.0, b.pattern, (unsigned long long)b.seed, b.runs);
+  printf("%-7s %-16s %12s %9s %8s %10s\n", "format", "stage", "lines/s", "MB/s", "ns/line", "check");
+
+  int rc = 0;
+  for (int f = 0; f < 3 && rc == 0; f++) {
+    if (b.format >= 0 && b.format != f) continue;
+    bench_corpus_t c;
+    if (!bench_generate(&c, (bench_format_t)f, &b)) {
+      fprintf(stderr, "OOM\n");
+      bench_corpus_free(&c);
+      rc = 1;
+      break;
+    }
+    const char *fmt = k_bench_formats[f];
+
+    FILE *tmp = tmpfile();
+    if (tmp && fwrite(c.text, 1, c.len, tmp) == c.len && fflush(tmp) == 0) {
+      int64_t best = -1;
+      uint64_t check = 0;
+      for (long k = 0; k < b.runs; k++) {
+        int64_t dt = bench_split(tmp, &check);
+        if (dt >= 0 && (best < 0 || dt < best)) best = dt;
+      }
+      if (best >= 0) bench_row(fmt, "split", best, &c, check);
+    } else {
+      fprintf(stderr, "split: temp file unavailable, skipped\n");
+    }
+    if (tmp) fclose(tmp);
+
+    struct {
+      const char *stage;
+      int kind;
+    } stages[] = {
+      {"filter builtin", 0},
+#if defined(LOGKNIFE_USE_PCRE2)
+      {"filter pcre2", 1},
+#endif
+      {f == BENCH_JSON ? "render json" : "highlight", 2},
+    };
+    for (size_t s = 0; s < sizeof(stages) / sizeof(stages[0]); s++) {
+      int64_t best = -1;
+      uint64_t check = 0;
+      for (long k = 0; k < b.runs; k++) {
+        int64_t dt;
+        if (stages[s].kind == 0) dt = bench_filter_builtin(&c, b.pattern, &check);
+        else if (stages[s].kind == 1) dt = bench_filter_re(&c, &re, &check);
+        else dt = bench_render(&c, sink, f == BENCH_JSON, &check);
+        if (best < 0 || dt < best) best = dt;
+      }
+      bench_row(fmt, stages[s].stage, best, &c, check);
+    }
+    bench_corpus_free(&c);
+  }
+
+  fclose(sink);
+  lk_re_free(&re);
+  return rc;
+}
+
+// -------------------------
+// bench follow
+// -------------------------
+// `logknife bench follow` measures follow mode end to end. A forked writer
+// appends lines stamped with now_ns() to a temp file; a forked follower runs
+// cmd_follow on it with stdout on a pipe, and the parent timestamps each line
+// as it comes out. CLOCK_MONOTONIC is shared between processes, so latency is
+// write-to-output. Each phase uses a fresh follower so wait4() gives its CPU
+// time. POSIX only.
+
+#ifndef _WIN32
+
+typedef struct {
+  double rate;          // lines/sec in the steady phase
+  long burst;           // lines per write
+  long duration;        // seconds of steady writing
+  long idle;            // seconds of the idle phase
+  long catchup;         // lines in the catch-up burst
+  int interval_ms;
+} follow_bench_opts_t;
+
+typedef struct {
+  pid_t pid;
+  int rfd;
+  char buf[1 << 16];
+  size_t len;
+  uint64_t received;
+  int64_t first_t;      // stamp of the first line seen
+  int64_t last_recv;    // now_ns() when the last line arrived
+  hist_t *lat;          // microseconds
+} follower_t;
+
+static void sleep_until_ns(int64_t deadline) {
+  int64_t d = deadline - now_ns();
+  if (d <= 0) return;
+  struct timespec ts;
+  ts.tv_sec = (time_t)(d / 1000000000LL);
+  ts.tv_nsec = (long)(d % 1000000000LL);
+  nanosleep(&ts, NULL);
+}
+
+static bool follower_start(follower_t *f, const char *path, int interval_ms) {
+  int fds[2];
+  if (pipe(fds) != 0) return false;
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    char iv[32];
+    snprintf(iv, sizeof(iv), "%d", interval_ms);
+    char *argv[] = {"logknife", "follow", (char *)path, "--interval", iv, NULL};
+    opts_t o;
+    if (!parse_args(5, argv, &o)) _exit(2);
+    _exit(cmd_follow(&o));
+  }
+  close(fds[1]);
+  f->pid = pid;
+  f->rfd = fds[0];
+  f->len = 0;
+  f->received = 0;
+  f->first_t = 0;
+  f->last_recv = 0;
+  // let it open the file and seek to the end before anything is written
+  sleep_ms(100);
+  return true;
+}
+
+// Read follower output until `want` lines arrived or the deadline passes.
+static void follower_read(follower_t *f, uint64_t want, int64_t deadline) {
+  while (f->received < want) {
+    int64_t left = deadline - now_ns();
+    if (left <= 0) return;
+    struct pollfd pfd = {f->rfd, POLLIN, 0};
+    int rc = poll(&pfd, 1, (int)(left / 1000000) + 1);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc <= 0) return;
+    ssize_t got = read(f->rfd, f->buf + f->len, sizeof(f->buf) - f->len);
+    if (got <= 0) return;
+    int64_t now = now_ns();
+    f->len += (size_t)got;
+
+    char *line = f->buf;
+    char *end = f->buf + f->len;
+    char *nl;
+    while ((nl = (char *)memchr(line, '\n', (size_t)(end - line))) != NULL) {
+      *nl = '\0';
+      const char *t = strstr(line, " t=");
+      if (t) {
+        int64_t stamp = strtoll(t + 3, NULL, 10);
+        if (f->received == 0) f->first_t = stamp;
+        if (f->lat) hist_record(f->lat, now > stamp ? (uint64_t)(now - stamp) / 1000 : 0);
+        f->received++;
+        f->last_recv = now;
+      }
+      line = nl + 1;
+    }
+    f->len = (size_t)(end - line);
+    memmove(f->buf, line, f->len);
+    if (f->len == sizeof(f->buf)) f->len = 0;  // not our output; drop it
+  }
+}
+
+// Stop the follower; returns its CPU seconds.
+static double follower_stop(follower_t *f) {
+  kill(f->pid, SIGINT);
+  char sink[4096];
+  while (read(f->rfd, sink, sizeof(sink)) > 0) {
+  }
+  close(f->rfd);
+  struct rusage ru;
+  memset(&ru, 0, sizeof(ru));
+  int status = 0;
+  while (wait4(f->pid, &status, 0, &ru) < 0 && errno == EINTR) {
+  }
+  return (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1e6 +
+         (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1e6;
+}
+
+// Append `lines` stamped lines in writes of `burst`, paced to `rate` lines/sec
+// (rate <= 0: as fast as possible). Runs in a forked child.
+static void writer_run(const char *path, uint64_t lines, long burst, double rate) {
+  int fd = open(path, O_WRONLY | O_APPEND);
+  if (fd < 0) _exit(1);
+  size_t cap = (size_t)burst * 96;
+  char *buf = (char *)malloc(cap);
+  if (!buf) _exit(1);
+  int64_t start = now_ns();
+  uint64_t seq = 0;
+  while (seq < lines) {
+    if (rate > 0.0) sleep_until_ns(start + (int64_t)((double)seq / rate * 1e9));
+    int64_t t = now_ns();
+    size_t len = 0;
+    for (long k = 0; k < burst && seq < lines; k++, seq++) {
+      len += (size_t)snprintf(buf + len, cap - len, "bench seq=%llu t=%lld level=INFO msg=\"synthetic follow line\"\n",
+                              (unsigned long long)seq, (long long)t);
+    }
+    size_t off = 0;
+    while (off < len) {
+      ssize_t w = write(fd, buf + off, len - off);
+      if (w <= 0) _exit(1);
+      off += (size_t)w;
+    }
+  }
+  free(buf);
+  close(fd);
+  _exit(0);
+}
+
+static pid_t writer_start(const char *path, uint64_t lines, long burst, double rate) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) writer_run(path, lines, burst, rate);
+  return pid;
+}
+
+static int parse_follow_bench_args(int argc, char **argv, follow_bench_opts_t *b) {
+  memset(b, 0, sizeof(*b));
+  b->rate = 1000.0;
+  b->burst = 1;
+  b->duration = 5;
+  b->idle = 2;
+  b->catchup = 1000000;
+  b->interval_ms = 200;
+
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+      b->rate = parse_rate(argv[++i]);
+      if (b->rate <= 0.0) {
+        fprintf(stderr, "Invalid --rate (use 1000 or 1000/s)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--burst") == 0 && i + 1 < argc) {
+      b->burst = strtol(argv[++i], NULL, 10);
+      if (b->burst < 1 || b->burst > 100000) {
+        fprintf(stderr, "Invalid --burst (1..100000)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+      b->duration = parse_duration_seconds(argv[++i]);
+      if (b->duration <= 0) {
+        fprintf(stderr, "Invalid duration for --duration (use 10s/10m/2h/1d)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--idle") == 0 && i + 1 < argc) {
+      b->idle = parse_duration_seconds(argv[++i]);
+      if (b->idle < 0) {
+        fprintf(stderr, "Invalid duration for --idle (use 10s/10m/2h/1d)\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--catchup") == 0 && i + 1 < argc) {
+      b->catchup = strtol(argv[++i], NULL, 10);
+      if (b->catchup < 0) b->catchup = 0;
+    } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+      b->interval_ms = atoi(argv[++i]);
+      if (b->interval_ms < 10) b->interval_ms = 10;
+    } else {
+      fprintf(stderr, "Unknown or incomplete arg: %s\n", argv[i]);
+      return 0;
+    }
+  }
+  return 1;
+}
 
-  // determine tail behavior
-  long tail = o->tail_lines;
-  if (tail <= 0 && o->since_seconds > 0) {
-    tail = (long)(o->since_seconds * o->since_rate_lps);
-    if (tail < 1) tail = 1;
-    if (tail > 100000) tail = 100000;
+static int cmd_bench_follow(int argc, char **argv) {
+  follow_bench_opts_t b;
+  if (!parse_follow_bench_args(argc, argv, &b)) {
+    usage(stderr);
+    return 2;
+  }
+
+  const char *dir = getenv("TMPDIR");
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/logknife-bench-XXXXXX", dir && *dir ? dir : "/tmp");
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create temp file: %s\n", strerror(errno));
+    return 1;
   }
+  close(fd);
 
-  if (tail > 0) {
-    tail_last_lines(fp, tail, o, includes ? includes : (re_t *)0, excludes ? excludes : (re_t *)0);
+  hist_t *lat = (hist_t *)calloc(1, sizeof(hist_t));
+  follower_t *f = (follower_t *)calloc(1, sizeof(follower_t));
+  if (!lat || !f) {
+    fprintf(stderr, "OOM\n");
+    free(lat);
+    free(f);
+    unlink(path);
+    return 1;
   }
+  int64_t slack = (int64_t)(b.interval_ms + 2000) * 1000000LL;
+  int rc = 0;
 
-  // Start following from end
-  fseek(fp, 0, SEEK_END);
-  int64_t last_size = file_size(fp);
+  printf("logknife bench follow: interval %dms, rate %.0f lines/s in bursts of %ld, %lds steady, %lds idle, %ld catch-up lines\n",
+         b.interval_ms, b.rate, b.burst, b.duration, b.idle, b.catchup);
 
-  char buf[8192];
+  // idle: nothing is written; CPU is the cost of polling
+  if (b.idle > 0) {
+    if (!follower_start(f, path, b.interval_ms)) goto fail;
+    int64_t t0 = now_ns();
+    sleep_until_ns(t0 + (int64_t)b.idle * 1000000000LL);
+    double secs = (double)(now_ns() - t0) / 1e9;
+    double cpu = follower_stop(f);
+    printf("  idle:     cpu %.2f%% (%.3fs over %.1fs)\n", cpu / secs * 100.0, cpu, secs);
+  }
 
-  for (;;) {
-    int c = fgetc(fp);
-    if (c == EOF) {
-      clearerr(fp);
+  // steady: paced writes, per-line latency
+  {
+    uint64_t want = (uint64_t)(b.rate * (double)b.duration);
+    if (want < 1) want = 1;
+    f->lat = lat;
+    if (!follower_start(f, path, b.interval_ms)) goto fail;
+    int64_t t0 = now_ns();
+    pid_t w = writer_start(path, want, b.burst, b.rate);
+    if (w < 0) {
+      follower_stop(f);
+      goto fail;
+    }
+    follower_read(f, want, t0 + (int64_t)b.duration * 1000000000LL + slack);
+    waitpid(w, NULL, 0);
+    double secs = (double)(now_ns() - t0) / 1e9;
+    double cpu = follower_stop(f);
+    f->lat = NULL;
+    printf("  steady:   %llu/%llu lines  latency p50 %.1fms p99 %.1fms max %.1fms  cpu %.2f%%\n",
+           (unsigned long long)f->received, (unsigned long long)want,
+           (double)hist_quantile(lat, 0.50) / 1000.0, (double)hist_quantile(lat, 0.99) / 1000.0,
+           (double)lat->max / 1000.0, cpu / secs * 100.0);
+  }
 
-      // truncation
-      int64_t sz = file_size(fp);
-      if (sz >= 0 && last_size >= 0 && sz < last_size) {
-        fseek(fp, 0, SEEK_SET);
+  // catch-up: one large burst written as fast as possible
+  if (b.catchup > 0) {
+    if (!follower_start(f, path, b.interval_ms)) goto fail;
+    pid_t w = writer_start(path, (uint64_t)b.catchup, 4096, 0.0);
+    if (w < 0) {
+      follower_stop(f);
+      goto fail;
+    }
+    follower_read(f, (uint64_t)b.catchup, now_ns() + 60 * 1000000000LL);
+    waitpid(w, NULL, 0);
+    follower_stop(f);
+    double secs = (double)(f->last_recv - f->first_t) / 1e9;
+    if (secs <= 0.0) secs = 1e-9;
+    printf("  catch-up: %llu/%ld lines in %.3fs  %.0f lines/s\n",
+           (unsigned long long)f->received, b.catchup, secs, (double)f->received / secs);
+  }
+  goto done;
+
+fail:
+  fprintf(stderr, "bench follow: %s\n", strerror(errno));
+  rc = 1;
+done:
+  free(lat);
+  free(f);
+  unlink(path);
+  return rc;
+}
+
+#else
+
+static int cmd_bench_follow(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  fprintf(stderr, "bench follow is not supported on Windows\n");
+  return 1;
+}
+
+#endif
+
+// -------------------------
+// ring reader
+// -------------------------
+// `logknife ring <file>` prints what a --ring writer publishes, as it
+// arrives. Reading is lk_ring_next() on the mapping; only an idle poll
+// sleeps, and once a second of idling also checks whether the writer
+// replaced the file (restarted with another --ring-size). POSIX only.
+
+#ifndef _WIN32
+
+typedef struct {
+  void *map;
+  size_t len;
+  ino_t ino;
+} ring_map_t;
+
+static bool ring_map(ring_map_t *m, const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  m->len = (size_t)st.st_size;
+  m->ino = st.st_ino;
+  m->map = m->len ? mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (m->map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s: %s\n", path, m->len ? strerror(errno) : "empty file");
+    return false;
+  }
+  return true;
+}
+
+static int cmd_ring(int argc, char **argv) {
+  if (argc < 3 || argv[2][0] == '-') {
+    fprintf(stderr, "Usage: logknife ring <file> [--from-start] [--interval ms]\n");
+    return 2;
+  }
+  const char *path = argv[2];
+  bool from_start = false;
+  int interval_ms = 10;
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--from-start") == 0) {
+      from_start = true;
+    } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+      interval_ms = (int)strtol(argv[++i], NULL, 10);
+      if (interval_ms < 1) interval_ms = 1;
+    } else {
+      fprintf(stderr, "Unknown or incomplete arg: %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  ring_map_t m;
+  lk_ring_reader r;
+  if (!ring_map(&m, path)) return 1;
+  if (!lk_ring_attach(&r, m.map, m.len, from_start)) {
+    fprintf(stderr, "%s is not a logknife ring\n", path);
+    munmap(m.map, m.len);
+    return 1;
+  }
+  char *line = (char *)malloc(MAX_LINE);
+  if (!line) {
+    fprintf(stderr, "OOM\n");
+    return 1;
+  }
+  on_signal(SIGINT, on_sigint);
+  int idle_ms = 0;
+  while (!g_stop) {
+    size_t len;
+    uint64_t lost;
+    if (lk_ring_next(&r, line, MAX_LINE, &len, &lost)) {
+      if (lost) fprintf(stderr, "logknife: lost %llu lines (reader too slow)\n", (unsigned long long)lost);
+      fwrite(line, 1, len < MAX_LINE ? len : MAX_LINE, stdout);
+      fputc('\n', stdout);
+      idle_ms = 0;
+      continue;
+    }
+    fflush(stdout);
+    sleep_ms(interval_ms);
+    if ((idle_ms += interval_ms) < 1000) continue;
+    idle_ms = 0;
+    struct stat st;
+    if (stat(path, &st) != 0 || st.st_ino == m.ino) continue;
+    ring_map_t fresh;
+    lk_ring_reader fr;
+    if (!ring_map(&fresh, path)) continue;
+    if (!lk_ring_attach(&fr, fresh.map, fresh.len, 1)) {
+      munmap(fresh.map, fresh.len);
+      continue;
+    }
+    munmap(m.map, m.len);
+    m = fresh;
+    r = fr;
+  }
+  fflush(stdout);
+  free(line);
+  munmap(m.map, m.len);
+  return 0;
+}
+
+#else
+
+static int cmd_ring(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  fprintf(stderr, "ring is not supported on Windows\n");
+  return 1;
+}
+
+#endif
+
+// -------------------------
+// serve: one follower, many subscribers
+// -------------------------
+// `logknife serve <socket> <file>...` follows the files once and streams
+// their lines to every subscriber on a unix socket. A subscriber sends its
+// filters as "include <pattern>" / "exclude <pattern>" lines ended by an
+// empty line, gets "ok" back (or "error: ..." and a hang-up), then every
+// line it selected. `logknife subscribe` is the matching client. POSIX only.
+//
+// Patterns are shared: one used by several subscribers is compiled once and
+// run at most once per line. Each pattern's required literal goes into one
+// Aho-Corasick automaton, so a single pass over the line tells which
+// patterns can match at all, and only those run their regex. Each
+// subscriber has a bounded output buffer; while it is full, that
+// subscriber's lines are dropped and counted, so a slow reader never holds up
+// the file or anyone else.
+
+#ifndef _WIN32
+
+#define AC_MAX_LITERAL 32            // longer literals are cut; a cut one is still required
+#define SERVE_MAX_SUBSCRIBERS 256
+#define SERVE_MAX_PATTERNS 1024      // distinct patterns over all subscribers
+#define SERVE_REQUEST_MAX 16384
+
+typedef struct {
+  int32_t next[256];   // goto function with the failure transitions folded in
+  int32_t fail;
+  int32_t lit;         // literal ending here, -1 if none
+  int32_t dict;        // nearest state on the failure chain ending a literal, -1 if none
+} ac_state_t;
+
+typedef struct {
+  ac_state_t *st;
+  size_t count, cap;
+} ac_t;
+
+static int32_t ac_new_state(ac_t *a) {
+  if (a->count == a->cap) {
+    size_t cap = a->cap ? a->cap * 2 : 64;
+    ac_state_t *n = (ac_state_t *)realloc(a->st, cap * sizeof(ac_state_t));
+    if (!n) return -1;
+    a->st = n;
+    a->cap = cap;
+  }
+  ac_state_t *s = &a->st[a->count];
+  for (int c = 0; c < 256; c++) s->next[c] = -1;
+  s->fail = 0;
+  s->lit = -1;
+  s->dict = -1;
+  return (int32_t)a->count++;
+}
+
+static void ac_free(ac_t *a) {
+  free(a->st);
+  memset(a, 0, sizeof(*a));
+}
+
+// Literal i of lits[0..n) is reported as i.
+static bool ac_build(ac_t *a, char **lits, size_t n) {
+  a->count = 0;
+  if (ac_new_state(a) < 0) return false;
+  for (size_t i = 0; i < n; i++) {
+    int32_t s = 0;
+    for (const unsigned char *p = (const unsigned char *)lits[i]; *p; p++) {
+      if (a->st[s].next[*p] < 0) {
+        int32_t t = ac_new_state(a);
+        if (t < 0) return false;
+        a->st[s].next[*p] = t;
       }
-      last_size = sz;
+      s = a->st[s].next[*p];
+    }
+    a->st[s].lit = (int32_t)i;
+  }
+  // breadth first, so a state's failure link is complete before its children's
+  int32_t *queue = (int32_t *)malloc(a->count * sizeof(int32_t));
+  if (!queue) return false;
+  size_t head = 0, tail = 0;
+  for (int c = 0; c < 256; c++) {
+    int32_t t = a->st[0].next[c];
+    if (t < 0) {
+      a->st[0].next[c] = 0;
+    } else {
+      a->st[t].fail = 0;
+      queue[tail++] = t;
+    }
+  }
+  while (head < tail) {
+    int32_t s = queue[head++];
+    int32_t f = a->st[s].fail;
+    a->st[s].dict = a->st[f].lit >= 0 ? f : a->st[f].dict;
+    for (int c = 0; c < 256; c++) {
+      int32_t t = a->st[s].next[c];
+      if (t < 0) {
+        a->st[s].next[c] = a->st[f].next[c];
+      } else {
+        a->st[t].fail = a->st[f].next[c];
+        queue[tail++] = t;
+      }
+    }
+  }
+  free(queue);
+  return true;
+}
 
-      sleep_ms(o->interval_ms);
+// Sets seen[i] = gen for every literal i that occurs in the text.
+static void ac_scan(const ac_t *a, const char *text, size_t len, uint32_t *seen, uint32_t gen) {
+  int32_t s = 0;
+  for (size_t i = 0; i < len; i++) {
+    s = a->st[s].next[(unsigned char)text[i]];
+    for (int32_t d = a->st[s].lit >= 0 ? s : a->st[s].dict; d >= 0; d = a->st[d].dict) {
+      seen[a->st[d].lit] = gen;
+    }
+  }
+}
+
+// The longest run of characters every match of pat contains (0 if none).
+// Built-in syntax: plain characters not followed by '*'. With PCRE2 only a
+// pattern without metacharacters counts, as a whole.
+static size_t required_literal(const char *pat, const char **lit) {
+#if defined(LOGKNIFE_USE_PCRE2)
+  if (strpbrk(pat, "\\^$.|?*+()[]{}")) return 0;
+  *lit = pat;
+  size_t n = strlen(pat);
+#else
+  size_t n = 0, run = 0;
+  const char *p = pat[0] == '^' ? pat + 1 : pat;
+  const char *start = p;
+  while (*p && !(p[0] == '$' && p[1] == '\0')) {
+    if (p[1] == '*' || p[0] == '.') {
+      p += p[1] == '*' ? 2 : 1;
+      start = p;
+      run = 0;
+      continue;
+    }
+    p++;
+    if (++run > n) {
+      n = run;
+      *lit = start;
+    }
+  }
+#endif
+  return n < AC_MAX_LITERAL ? n : AC_MAX_LITERAL;
+}
+
+typedef struct {
+  char *pat;            // NULL: free slot
+  lk_re_t re;
+  int32_t lit;          // literal in the automaton, -1: the regex always runs
+  uint32_t refs;
+  uint32_t gen;         // line the cached result is for
+  bool result;
+} serve_pattern_t;
+
+typedef struct {
+  int fd;
+  bool streaming;       // request accepted, lines are being sent
+  bool eof;             // the subscriber closed its side; only writes are left
+  char req[SERVE_REQUEST_MAX + 2];
+  size_t req_len;
+  int32_t *inc, *exc;   // indices into the pattern table
+  size_t inc_count, exc_count;
+  char *out;            // pending output is [out_start, out_end) of --buffer bytes
+  size_t out_start, out_end;
+  uint64_t dropped;     // lines lost since the buffer last had room
+} subscriber_t;
+
+typedef struct {
+  const char *path;
+  char prefix[512];     // "path: " when serving several files
+  size_t prefix_len;
+  FILE *fp;
+  reader_t r;
+  int64_t last_size;
+} served_file_t;
+
+typedef struct {
+  int listen_fd;
+  size_t buffer;
+  served_file_t *files;
+  size_t file_count;
+  subscriber_t *subs[SERVE_MAX_SUBSCRIBERS];
+  size_t sub_count;
+  serve_pattern_t pats[SERVE_MAX_PATTERNS];
+  size_t pat_count;     // slots in use or freed
+  char *lits[SERVE_MAX_PATTERNS];
+  size_t lit_count;
+  uint32_t seen[SERVE_MAX_PATTERNS];
+  ac_t ac;
+  uint32_t gen;         // current line
+  bool dirty;           // the pattern set changed; rebuild before the next line
+} server_t;
+
+static int32_t serve_pattern_ref(server_t *s, const char *pat, char *err, size_t err_len) {
+  size_t slot = s->pat_count;
+  for (size_t i = 0; i < s->pat_count; i++) {
+    if (!s->pats[i].pat) {
+      if (slot == s->pat_count) slot = i;
+    } else if (strcmp(s->pats[i].pat, pat) == 0) {
+      s->pats[i].refs++;
+      return (int32_t)i;
+    }
+  }
+  if (slot == SERVE_MAX_PATTERNS) {
+    snprintf(err, err_len, "too many distinct patterns on this server");
+    return -1;
+  }
+  serve_pattern_t *p = &s->pats[slot];
+  memset(p, 0, sizeof(*p));
+  p->pat = strndup_s(pat, strlen(pat));
+  if (!p->pat) {
+    snprintf(err, err_len, "OOM");
+    return -1;
+  }
+  if (!lk_re_compile(&p->re, p->pat)) {
+    snprintf(err, err_len, "invalid pattern: %.200s", pat);
+    free(p->pat);
+    p->pat = NULL;
+    return -1;
+  }
+  p->refs = 1;
+  p->lit = -1;
+  if (slot == s->pat_count) s->pat_count++;
+  s->dirty = true;
+  return (int32_t)slot;
+}
+
+static void serve_pattern_unref(server_t *s, int32_t i) {
+  serve_pattern_t *p = &s->pats[i];
+  if (--p->refs > 0) return;
+  lk_re_free(&p->re);
+  free(p->pat);
+  p->pat = NULL;
+  s->dirty = true;
+}
+
+// Collects the distinct required literals of live patterns into a new
+// automaton. If that fails every regex just runs.
+static void serve_rebuild(server_t *s) {
+  for (size_t i = 0; i < s->lit_count; i++) free(s->lits[i]);
+  s->lit_count = 0;
+  bool ok = true;
+  for (size_t i = 0; i < s->pat_count; i++) {
+    serve_pattern_t *p = &s->pats[i];
+    p->lit = -1;
+    p->gen = 0;
+    const char *lit = NULL;
+    size_t n = p->pat ? required_literal(p->pat, &lit) : 0;
+    if (n == 0) continue;
+    size_t k = 0;
+    while (k < s->lit_count && !(strlen(s->lits[k]) == n && memcmp(s->lits[k], lit, n) == 0)) k++;
+    if (k == s->lit_count) {
+      s->lits[k] = strndup_s(lit, n);
+      if (!s->lits[k]) {
+        ok = false;
+        break;
+      }
+      s->lit_count++;
+    }
+    p->lit = (int32_t)k;
+  }
+  if (!ok || !ac_build(&s->ac, s->lits, s->lit_count)) {
+    for (size_t i = 0; i < s->pat_count; i++) s->pats[i].lit = -1;
+    for (size_t i = 0; i < s->lit_count; i++) free(s->lits[i]);
+    s->lit_count = 0;
+  }
+  memset(s->seen, 0, sizeof(s->seen));
+  s->gen = 0;
+  s->dirty = false;
+}
+
+static bool serve_pattern_match(server_t *s, int32_t i, const char *line, size_t len) {
+  serve_pattern_t *p = &s->pats[i];
+  if (p->gen != s->gen) {
+    p->gen = s->gen;
+    p->result = (p->lit < 0 || s->seen[p->lit] == s->gen) && lk_re_match(&p->re, line, len);
+  }
+  return p->result;
+}
+
+// Makes room for need more bytes, compacting the buffer if that helps.
+static bool sub_reserve(subscriber_t *c, size_t cap, size_t need) {
+  if (cap - c->out_end >= need) return true;
+  if (c->out_start > 0) {
+    memmove(c->out, c->out + c->out_start, c->out_end - c->out_start);
+    c->out_end -= c->out_start;
+    c->out_start = 0;
+  }
+  return cap - c->out_end >= need;
+}
+
+static void sub_append(subscriber_t *c, const char *data, size_t len) {
+  memcpy(c->out + c->out_end, data, len);
+  c->out_end += len;
+}
+
+static void sub_line(const server_t *s, subscriber_t *c, const served_file_t *f, const char *line, size_t len) {
+  char note[96];
+  int nn = 0;
+  if (c->dropped) {
+    nn = snprintf(note, sizeof(note), "logknife: dropped %llu lines (subscriber too slow)\n",
+                  (unsigned long long)c->dropped);
+  }
+  if (!sub_reserve(c, s->buffer, (size_t)nn + f->prefix_len + len + 1)) {
+    c->dropped++;
+    return;
+  }
+  sub_append(c, note, (size_t)nn);
+  sub_append(c, f->prefix, f->prefix_len);
+  sub_append(c, line, len);
+  sub_append(c, "\n", 1);
+  c->dropped = 0;
+}
+
+// Sends what is pending without blocking; false if the subscriber is gone.
+static bool sub_flush(subscriber_t *c) {
+  while (c->out_start < c->out_end) {
+    ssize_t w = send(c->fd, c->out + c->out_start, c->out_end - c->out_start, MSG_NOSIGNAL);
+    if (w < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    c->out_start += (size_t)w;
+  }
+  c->out_start = c->out_end = 0;
+  return true;
+}
+
+static void serve_line(server_t *s, const served_file_t *f, char *line) {
+  size_t len = rstrip_newlines(line);
+  if (s->sub_count == 0) return;
+  if (++s->gen == 0) {  // wrapped: no cached result may look current
+    for (size_t i = 0; i < s->pat_count; i++) s->pats[i].gen = 0;
+    memset(s->seen, 0, sizeof(s->seen));
+    s->gen = 1;
+  }
+  if (s->lit_count) ac_scan(&s->ac, line, len, s->seen, s->gen);
+  for (size_t k = 0; k < s->sub_count; k++) {
+    subscriber_t *c = s->subs[k];
+    if (!c->streaming) continue;
+    bool keep = c->inc_count == 0;
+    for (size_t i = 0; i < c->inc_count && !keep; i++) keep = serve_pattern_match(s, c->inc[i], line, len);
+    for (size_t i = 0; i < c->exc_count && keep; i++) keep = !serve_pattern_match(s, c->exc[i], line, len);
+    if (keep) sub_line(s, c, f, line, len);
+  }
+}
+
+static void serve_drop(server_t *s, size_t k) {
+  subscriber_t *c = s->subs[k];
+  for (size_t i = 0; i < c->inc_count; i++) serve_pattern_unref(s, c->inc[i]);
+  for (size_t i = 0; i < c->exc_count; i++) serve_pattern_unref(s, c->exc[i]);
+  close(c->fd);
+  free(c->inc);
+  free(c->exc);
+  free(c->out);
+  free(c);
+  s->subs[k] = s->subs[--s->sub_count];
+}
+
+static void sub_error(subscriber_t *c, const char *msg) {
+  char buf[256];
+  int n = snprintf(buf, sizeof(buf), "error: %s\n", msg);
+  if (n > 0) send_all(c->fd, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+// Length of the request through its terminating empty line, 0 if incomplete.
+static size_t request_end(const char *req, size_t len) {
+  size_t line = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (req[i] != '\n') continue;
+    size_t n = i - line;
+    if (n == 0 || (n == 1 && req[line] == '\r')) return i + 1;
+    line = i + 1;
+  }
+  return 0;
+}
+
+static bool serve_subscribe(server_t *s, subscriber_t *c, size_t end, char *err, size_t err_len) {
+  size_t lines = 0;
+  for (size_t i = 0; i < end; i++) lines += c->req[i] == '\n';
+  c->inc = (int32_t *)calloc(lines, sizeof(int32_t));
+  c->exc = (int32_t *)calloc(lines, sizeof(int32_t));
+  if (!c->inc || !c->exc) {
+    snprintf(err, err_len, "OOM");
+    return false;
+  }
+  char *p = c->req;
+  for (;;) {
+    char *nl = (char *)memchr(p, '\n', (size_t)(c->req + end - p));
+    *nl = '\0';
+    size_t n = (size_t)(nl - p);
+    if (n > 0 && p[n - 1] == '\r') p[--n] = '\0';
+    if (n == 0) return true;
+    int32_t id;
+    if (strncmp(p, "include ", 8) == 0) {
+      if ((id = serve_pattern_ref(s, p + 8, err, err_len)) < 0) return false;
+      c->inc[c->inc_count++] = id;
+    } else if (strncmp(p, "exclude ", 8) == 0) {
+      if ((id = serve_pattern_ref(s, p + 8, err, err_len)) < 0) return false;
+      c->exc[c->exc_count++] = id;
+    } else {
+      snprintf(err, err_len, "unknown request line: %.60s", p);
+      return false;
+    }
+    p = nl + 1;
+  }
+}
+
+// Reads what the subscriber sent; false if it should be dropped.
+static bool serve_read(server_t *s, subscriber_t *c) {
+  char junk[512];
+  char *dst = c->streaming ? junk : c->req + c->req_len;
+  size_t room = c->streaming ? sizeof(junk) : SERVE_REQUEST_MAX - c->req_len;
+  ssize_t got = read(c->fd, dst, room);
+  if (got < 0) return errno == EAGAIN || errno == EINTR;
+  if (c->streaming) {
+    if (got == 0) c->eof = true;
+    return true;
+  }
+  if (got == 0) {
+    if (c->req_len == 0) return false;
+    c->eof = true;
+    memcpy(c->req + c->req_len, "\n\n", 2);  // the request ends with the stream
+    c->req_len += 2;
+  } else {
+    c->req_len += (size_t)got;
+  }
+
+  size_t end = request_end(c->req, c->req_len);
+  if (end == 0) {
+    if (c->req_len < SERVE_REQUEST_MAX) return true;
+    sub_error(c, "request too long");
+    return false;
+  }
+  char err[256];
+  if (!serve_subscribe(s, c, end, err, sizeof(err))) {
+    sub_error(c, err);
+    return false;
+  }
+  c->out = (char *)malloc(s->buffer);
+  if (!c->out) {
+    sub_error(c, "OOM");
+    return false;
+  }
+  sub_append(c, "ok\n", 3);
+  c->streaming = true;
+  return true;
+}
+
+static void serve_accept(server_t *s) {
+  for (;;) {
+    int fd = accept(s->listen_fd, NULL, NULL);
+    if (fd < 0) return;
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    fd_nonblock_cloexec(fd);
+    subscriber_t *c = NULL;
+    if (s->sub_count < SERVE_MAX_SUBSCRIBERS) c = (subscriber_t *)calloc(1, sizeof(subscriber_t));
+    if (!c) {
+      static const char full[] = "error: too many subscribers\n";
+      send_all(fd, full, sizeof(full) - 1);
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    s->subs[s->sub_count++] = c;
+  }
+}
+
+// One read of each file; true if any had new data.
+static bool serve_files(server_t *s) {
+  bool more = false;
+  for (size_t i = 0; i < s->file_count; i++) {
+    served_file_t *f = &s->files[i];
+    size_t got = reader_fill(&f->r);
+    char *line;
+    while ((line = reader_next(&f->r, false)) != NULL) serve_line(s, f, line);
+    if (got > 0) {
+      more = true;
       continue;
     }
+    // truncation
+    int64_t sz = file_size(f->fp);
+    if (sz >= 0 && f->last_size >= 0 && sz < f->last_size) {
+      fd_seek(f->fp, 0, SEEK_SET);
+      reader_reset(&f->r);
+    }
+    f->last_size = sz;
+  }
+  return more;
+}
+
+static int cmd_serve(int argc, char **argv) {
+  if (argc < 4 || argv[2][0] == '-') {
+    fprintf(stderr, "Usage: logknife serve <socket> <file>... [--interval ms] [--buffer size]\n");
+    return 2;
+  }
+  const char *sock = argv[2];
+  int interval_ms = 200;
+  int64_t buffer = 1 << 20;
+  const char **paths = (const char **)calloc((size_t)argc, sizeof(char *));
+  size_t npaths = 0;
+  if (!paths) {
+    fprintf(stderr, "OOM\n");
+    return 1;
+  }
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+      interval_ms = (int)strtol(argv[++i], NULL, 10);
+      if (interval_ms < 1) interval_ms = 1;
+    } else if (strcmp(argv[i], "--buffer") == 0 && i + 1 < argc) {
+      buffer = parse_size(argv[++i]);
+      if (buffer < 4096) {
+        fprintf(stderr, "Invalid --buffer (at least 4K)\n");
+        free(paths);
+        return 2;
+      }
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "Unknown or incomplete arg: %s\n", argv[i]);
+      free(paths);
+      return 2;
+    } else {
+      paths[npaths++] = argv[i];
+    }
+  }
+  if (npaths == 0) {
+    fprintf(stderr, "serve needs at least one file\n");
+    free(paths);
+    return 2;
+  }
+
+  server_t *s = (server_t *)calloc(1, sizeof(server_t));
+  served_file_t *files = (served_file_t *)calloc(npaths, sizeof(served_file_t));
+  struct pollfd *pfds = (struct pollfd *)calloc(SERVE_MAX_SUBSCRIBERS + 1, sizeof(struct pollfd));
+  if (!s || !files || !pfds) {
+    fprintf(stderr, "OOM\n");
+    return 1;
+  }
+  s->buffer = (size_t)buffer;
+  s->files = files;
+  int rc = 0;
+  for (size_t i = 0; i < npaths; i++) {
+    served_file_t *f = &files[i];
+    f->path = paths[i];
+    f->fp = fopen(f->path, "rb");
+    if (!f->fp) {
+      fprintf(stderr, "Failed to open %s: %s\n", f->path, strerror(errno));
+      rc = 1;
+      break;
+    }
+    s->file_count++;
+    if (!reader_init(&f->r, f->fp)) {
+      fprintf(stderr, "OOM\n");
+      rc = 1;
+      break;
+    }
+    if (npaths > 1) {
+      int n = snprintf(f->prefix, sizeof(f->prefix), "%s: ", f->path);
+      f->prefix_len = n > 0 && (size_t)n < sizeof(f->prefix) ? (size_t)n : 0;
+    }
+    fd_seek(f->fp, 0, SEEK_END);
+    f->last_size = file_size(f->fp);
+  }
+  s->listen_fd = rc == 0 ? unix_listen(sock, "serve socket") : -1;
+  if (s->listen_fd < 0) rc = 1;
+
+  on_signal(SIGINT, on_sigint);
+  on_signal(SIGTERM, on_sigint);
+
+  while (rc == 0 && !g_stop) {
+    bool more = serve_files(s);
+    if (s->dirty) serve_rebuild(s);
+
+    pfds[0].fd = s->listen_fd;
+    pfds[0].events = POLLIN;
+    for (size_t k = 0; k < s->sub_count; k++) {
+      const subscriber_t *c = s->subs[k];
+      pfds[k + 1].fd = c->fd;
+      pfds[k + 1].events = (short)((c->eof ? 0 : POLLIN) | (c->out_end > c->out_start ? POLLOUT : 0));
+      pfds[k + 1].revents = 0;
+    }
+    if (poll(pfds, s->sub_count + 1, more ? 0 : interval_ms) <= 0) continue;
+
+    // backwards, so dropping one only moves an already handled subscriber
+    for (size_t k = s->sub_count; k-- > 0;) {
+      subscriber_t *c = s->subs[k];
+      short re = pfds[k + 1].revents;
+      bool ok = !(re & (POLLERR | POLLHUP | POLLNVAL));
+      if (ok && (re & POLLIN)) ok = serve_read(s, c);
+      if (ok && (re & POLLOUT)) ok = sub_flush(c);
+      if (!ok) serve_drop(s, k);
+    }
+    if (pfds[0].revents & POLLIN) serve_accept(s);
+  }
+
+  while (s->sub_count > 0) serve_drop(s, s->sub_count - 1);
+  for (size_t i = 0; i < s->lit_count; i++) free(s->lits[i]);
+  ac_free(&s->ac);
+  if (s->listen_fd >= 0) {
+    close(s->listen_fd);
+    unix_unlink(sock, "serve socket");
+  }
+  for (size_t i = 0; i < s->file_count; i++) {
+    reader_free(&files[i].r);
+    fclose(files[i].fp);
+  }
+  free(files);
+  free(pfds);
+  free(s);
+  free(paths);
+  return rc;
+}
 
-    ungetc(c, fp);
-    if (!fgets(buf, (int)sizeof(buf), fp)) continue;
+// `logknife subscribe <socket> [--include p]... [--exclude p]...`: send the
+// request, then copy lines to stdout until the server goes away.
+static int cmd_subscribe(int argc, char **argv) {
+  if (argc < 3 || argv[2][0] == '-') {
+    fprintf(stderr, "Usage: logknife subscribe <socket> [--include pattern]... [--exclude pattern]...\n");
+    return 2;
+  }
+  char req[SERVE_REQUEST_MAX];
+  size_t len = 0;
+  for (int i = 3; i < argc; i++) {
+    const char *kind = NULL;
+    if (strcmp(argv[i], "--include") == 0 && i + 1 < argc) kind = "include";
+    if (strcmp(argv[i], "--exclude") == 0 && i + 1 < argc) kind = "exclude";
+    if (!kind || strchr(argv[i + 1], '\n')) {
+      fprintf(stderr, "Unknown or incomplete arg: %s\n", argv[i]);
+      return 2;
+    }
+    int n = snprintf(req + len, sizeof(req) - len, "%s %s\n", kind, argv[++i]);
+    if (n < 0 || (size_t)n >= sizeof(req) - len - 1) {
+      fprintf(stderr, "Too many patterns\n");
+      return 2;
+    }
+    len += (size_t)n;
+  }
+  req[len++] = '\n';
 
-    if (!should_print(o, includes ? includes : (re_t *)0, excludes ? excludes : (re_t *)0, buf)) continue;
+  struct sockaddr_un addr;
+  if (!unix_addr(&addr, argv[2], "subscribe socket")) return 2;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "Failed to connect to %s: %s\n", argv[2], strerror(errno));
+    if (fd >= 0) close(fd);
+    return 1;
+  }
+  if (!send_all(fd, req, len)) {
+    fprintf(stderr, "Failed to send request: %s\n", strerror(errno));
+    close(fd);
+    return 1;
+  }
 
-    print_line(o, buf);
+  // the first line is the server's answer; everything after it is log lines
+  static char buf[1 << 16];
+  size_t have = 0;
+  char *nl = NULL;
+  while (!nl && have < sizeof(buf)) {
+    ssize_t got = read(fd, buf + have, sizeof(buf) - have);
+    if (got <= 0) break;
+    have += (size_t)got;
+    nl = (char *)memchr(buf, '\n', have);
+  }
+  if (!nl || (size_t)(nl - buf) != 2 || memcmp(buf, "ok", 2) != 0) {
+    fprintf(stderr, "%.*s\n", nl ? (int)(nl - buf) : 0, buf);
+    if (!nl) fprintf(stderr, "Server closed the connection\n");
+    close(fd);
+    return 1;
+  }
+  size_t start = (size_t)(nl - buf) + 1;
+  for (;;) {
+    if (have > start && fwrite(buf + start, 1, have - start, stdout) != have - start) break;
     fflush(stdout);
+    ssize_t got = read(fd, buf, sizeof(buf));
+    if (got <= 0) break;
+    start = 0;
+    have = (size_t)got;
   }
+  close(fd);
+  return 0;
+}
+
+#else
 
-  // unreachable
+static int cmd_serve(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  fprintf(stderr, "serve is not supported on Windows\n");
+  return 1;
+}
+
+static int cmd_subscribe(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  fprintf(stderr, "subscribe is not supported on Windows\n");
+  return 1;
 }
 
+#endif
+
+#ifndef LOGKNIFE_NO_MAIN
 int main(int argc, char **argv) {
   enable_ansi_if_windows();
 
+  if (argc >= 2 && strcmp(argv[1], "bench") == 0) return cmd_bench(argc, argv);
+  if (argc >= 2 && strcmp(argv[1], "serve") == 0) return cmd_serve(argc, argv);
+  if (argc >= 2 && strcmp(argv[1], "subscribe") == 0) return cmd_subscribe(argc, argv);
+  if (argc >= 2 && strcmp(argv[1], "ring") == 0) return cmd_ring(argc, argv);
+
   opts_t o;
   if (!parse_args(argc, argv, &o)) {
     usage(stderr);
@@ -613,3 +5826,4 @@ int main(int argc, char **argv) {
 
   return cmd_follow(&o);
 }
+#endif
@@ -0,0 +1,157 @@
+// liblogknife: rules and the line splitter, driven through the public API only.
+// Inputs are pushed whole, byte at a time and split at every offset; the
+// callback must see the same lines each way.
+
+#include "logknife.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int failures;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+// Kept lines joined with '|', each followed by one.
+typedef struct {
+  char out[1024];
+  size_t len;
+} collect_t;
+
+static void collect(void *user, const char *line, size_t len) {
+  collect_t *c = (collect_t *)user;
+  if (c->len + len + 1 >= sizeof(c->out)) return;
+  memcpy(c->out + c->len, line, len);
+  c->len += len;
+  c->out[c->len++] = '|';
+  c->out[c->len] = '\0';
+}
+
+typedef struct {
+  collect_t got;
+  uint64_t lines, kept, truncated;
+} result_t;
+
+static void run(const lk_rules *rules, size_t cap, const char *in, size_t step, size_t split, result_t *r) {
+  char buf[256];
+  lk_stream s;
+  memset(r, 0, sizeof(*r));
+  lk_stream_init(&s, rules, buf, cap, collect, &r->got);
+  size_t len = strlen(in);
+  if (split > 0) {
+    lk_stream_push(&s, in, split);
+    lk_stream_push(&s, in + split, len - split);
+  } else {
+    for (size_t off = 0; off < len; off += step) lk_stream_push(&s, in + off, len - off < step ? len - off : step);
+  }
+  lk_stream_finish(&s);
+  r->lines = s.lines;
+  r->kept = s.kept;
+  r->truncated = s.truncated;
+}
+
+// Same result however the input is chunked. A line longer than cap is only
+// cut when it arrives in pieces (whole lines are passed in place), so inputs
+// that expect truncation are pushed byte at a time only.
+static void expect(const lk_rules *rules, size_t cap, const char *in, const char *want, uint64_t lines,
+                   uint64_t truncated) {
+  size_t len = strlen(in);
+  result_t r;
+  for (size_t pass = truncated ? 1 : 0; pass <= (truncated ? 1 : len + 1); pass++) {
+    if (pass == 0) run(rules, cap, in, len ? len : 1, 0, &r);   // whole
+    else if (pass == 1) run(rules, cap, in, 1, 0, &r);          // byte at a time
+    else run(rules, cap, in, 0, pass - 1, &r);                  // split at pass - 1
+    if (strcmp(r.got.out, want) != 0 || r.lines != lines) {
+      fprintf(stderr, "input \"%s\" (pass %zu): got \"%s\" (%llu lines), want \"%s\" (%llu lines)\n", in, pass,
+              r.got.out, (unsigned long long)r.lines, want, (unsigned long long)lines);
+      failures++;
+      return;
+    }
+    if (r.truncated != truncated) {
+      fprintf(stderr, "input \"%s\" (pass %zu): %llu truncated, want %llu\n", in, pass,
+              (unsigned long long)r.truncated, (unsigned long long)truncated);
+      failures++;
+      return;
+    }
+  }
+}
+
+static void test_stream(void) {
+  expect(NULL, 64, "", "", 0, 0);
+  expect(NULL, 64, "a\nbb\n\nccc\n", "a|bb||ccc|", 4, 0);
+  expect(NULL, 64, "dos\r\nline\r\n", "dos|line|", 2, 0);
+  // no trailing newline: lk_stream_finish emits the last line
+  expect(NULL, 64, "first\nlast", "first|last|", 2, 0);
+  // longer than the buffer: cut at cap and counted
+  expect(NULL, 8, "short\n0123456789abcdef\nend\n", "short|01234567|end|", 3, 1);
+  expect(NULL, 8, "01234567\n", "01234567|", 1, 0);
+  expect(NULL, 8, "0123456789", "01234567|", 1, 1);
+}
+
+// Rules as lk_rules_match_each evaluated them: "0+2-" is rule 0 matched, rule 2 did not.
+static void on_rule(void *user, size_t rule, int matched) {
+  char *trace = (char *)user;
+  size_t n = strlen(trace);
+  if (n + 3 > 32) return;
+  trace[n] = (char)('0' + rule);
+  trace[n + 1] = matched ? '+' : '-';
+  trace[n + 2] = '\0';
+}
+
+static int match_each(const lk_rules *rules, const char *line, int all_includes, char trace[32]) {
+  trace[0] = '\0';
+  int kept = lk_rules_match_each(rules, line, strlen(line), all_includes, on_rule, trace);
+  CHECK(kept == lk_rules_match(rules, line, strlen(line)));
+  return kept;
+}
+
+static void test_rules(void) {
+  char err[256];
+  const char *inc[] = { "ERROR", "^panic" };
+  const char *exc[] = { "noise" };
+  lk_rules *rules = lk_rules_compile(inc, 2, exc, 1, err, sizeof(err));
+  CHECK(rules != NULL);
+  if (!rules) return;
+
+  CHECK(lk_rules_match(rules, "an ERROR here", 13));
+  CHECK(lk_rules_match(rules, "panic: boom", 11));
+  CHECK(!lk_rules_match(rules, "no panic", 8));
+  CHECK(!lk_rules_match(rules, "ERROR noise", 11));
+  CHECK(!lk_rules_match(rules, "info", 4));
+  // not NUL-terminated: only len bytes count
+  CHECK(!lk_rules_match(rules, "ERRORS", 4));
+
+  expect(rules, 16, "ok\nERROR one\nERROR noise\npanic: two\nERROR three", "ERROR one|panic: two|ERROR three|", 5, 0);
+
+  // per-rule callbacks: includes first, then excludes
+  char trace[32];
+  CHECK(match_each(rules, "ERROR x", 0, trace) == 1 && strcmp(trace, "0+2-") == 0);
+  CHECK(match_each(rules, "ERROR x", 1, trace) == 1 && strcmp(trace, "0+1-2-") == 0);
+  CHECK(match_each(rules, "ERROR noise", 0, trace) == 0 && strcmp(trace, "0+2+") == 0);
+  CHECK(match_each(rules, "info", 0, trace) == 0 && strcmp(trace, "0-1-") == 0);
+
+  lk_rules_free(rules);
+
+  lk_rules *none = lk_rules_compile(NULL, 0, NULL, 0, err, sizeof(err));
+  CHECK(none != NULL);
+  if (none) {
+    CHECK(lk_rules_match(none, "anything", 8));
+    lk_rules_free(none);
+  }
+}
+
+int main(void) {
+  test_stream();
+  test_rules();
+  if (failures) {
+    fprintf(stderr, "%d failure(s)\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,209 @@
+// include/logknife_ring.h against rings `logknife scan --ring` wrote: the
+// oldest records after the ring has wrapped, a reader that was lapped, and
+// a record the writer started overwriting while it was being read.
+//
+//   ring_test <path to logknife>
+
+#include "logknife_ring.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *g_logknife;
+static int failures;
+
+#define CHECK(cond)                                                             \
+  do {                                                                          \
+    if (!(cond)) {                                                              \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                               \
+    }                                                                           \
+  } while (0)
+
+#define RING "ring_test.ring"
+#define LINES 5000  // a 64K ring holds about 1000 of them
+
+typedef struct {
+  void *map;
+  size_t len;
+  lk_ring_reader r;
+} ring_map_t;
+
+// Publishes "<word> 000000" .. "<word> LINES-1" into the ring.
+static void publish(const char *word) {
+  FILE *fp = fopen("ring_test.log", "wb");
+  if (!fp) {
+    perror("ring_test.log");
+    exit(1);
+  }
+  for (int i = 0; i < LINES; i++) fprintf(fp, "%s %06d\n", word, i);
+  fclose(fp);
+  char cmd[1024];
+  snprintf(cmd, sizeof(cmd), "\"%s\" scan ring_test.log --ring " RING " --ring-size 64K", g_logknife);
+  if (system(cmd) != 0) {
+    fprintf(stderr, "%s failed\n", cmd);
+    exit(1);
+  }
+}
+
+// Maps the ring writable, so a test can act as a writer half way through.
+static void attach(ring_map_t *m, int from_start) {
+  int fd = open(RING, O_RDWR);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(RING);
+    exit(1);
+  }
+  m->len = (size_t)st.st_size;
+  m->map = mmap(NULL, m->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m->map == MAP_FAILED || !lk_ring_attach(&m->r, m->map, m->len, from_start)) {
+    fprintf(stderr, "%s is not a ring\n", RING);
+    exit(1);
+  }
+}
+
+// Reads everything published; records must be whole and in order. Returns
+// how many were read; *first is the first one's number, *lost the total lost.
+static int drain(ring_map_t *m, const char *word, int *first, uint64_t *lost_total) {
+  char line[64];
+  size_t len;
+  uint64_t lost;
+  int n = 0, prev = -1;
+  *lost_total = 0;
+  while (lk_ring_next(&m->r, line, sizeof(line) - 1, &len, &lost)) {
+    line[len < sizeof(line) - 1 ? len : sizeof(line) - 1] = '\0';
+    char w[16];
+    int num = -1;
+    if (sscanf(line, "%15s %d", w, &num) != 2 || strcmp(w, word) != 0 || len != strlen(word) + 7) {
+      fprintf(stderr, "torn or foreign record \"%s\"\n", line);
+      failures++;
+      return n;
+    }
+    if (n == 0) *first = num;
+    else if (num != prev + 1 + (int)lost) {
+      fprintf(stderr, "record %d after %d with %llu lost\n", num, prev, (unsigned long long)lost);
+      failures++;
+    }
+    *lost_total += lost;
+    prev = num;
+    n++;
+  }
+  CHECK(prev == LINES - 1);
+  return n;
+}
+
+// After wrapping, a reader from the start gets the oldest intact record on,
+// with nothing lost; a reader from now gets nothing.
+static void test_wrapped(void) {
+  unlink(RING);
+  publish("first");
+  ring_map_t m;
+  attach(&m, 1);
+  int first = -1;
+  uint64_t lost = 0;
+  int n = drain(&m, "first", &first, &lost);
+  CHECK(lost == 0);
+  CHECK(first > 0 && first + n == LINES);
+  CHECK(n > 500);
+
+  ring_map_t now;
+  attach(&now, 0);
+  char line[64];
+  size_t len;
+  CHECK(!lk_ring_next(&now.r, line, sizeof(line), &len, &lost));
+  munmap(m.map, m.len);
+  munmap(now.map, now.len);
+}
+
+// A reader that falls a whole ring behind while another run reuses the
+// ring is told how many records it lost, and resumes at the oldest intact
+// one.
+static void test_lapped(void) {
+  ring_map_t m;
+  attach(&m, 1);  // still holds the end of "first"
+  uint64_t before = atomic_load(&m.r.h->seq);
+  uint64_t unread = before - m.r.next_seq + 1;
+  publish("second");
+  uint64_t published = atomic_load(&m.r.h->seq) - before;
+  CHECK(published == LINES);
+
+  char line[64];
+  size_t len;
+  uint64_t lost = 0;
+  CHECK(lk_ring_next(&m.r, line, sizeof(line), &len, &lost));
+  CHECK(lost > unread);
+  int first = -1;
+  CHECK(sscanf(line, "second %d", &first) == 1 && (uint64_t)first == lost - unread);
+  uint64_t more_lost = 0;
+  int n = drain(&m, "second", &first, &more_lost);
+  CHECK(more_lost == 0);
+  CHECK(lost + 1 + (uint64_t)n == unread + LINES);
+  munmap(m.map, m.len);
+}
+
+// The writer claims the oldest records for a new one (moving tail and
+// reserve) and scribbles over them while a reader is copying the oldest:
+// the reader must drop that copy and carry on from the new tail.
+static void test_torn(void) {
+  ring_map_t m;
+  attach(&m, 1);
+  lk_ring_header *h = (lk_ring_header *)m.map;
+  unsigned char *data = (unsigned char *)m.map + LK_RING_HEADER;
+  uint64_t cap = h->capacity;
+  uint64_t oldest_seq = m.r.next_seq;
+
+  // what ring_publish does before it publishes: claim room for a large
+  // record, advancing tail over the records it will overwrite
+  uint64_t head = atomic_load(&h->head);
+  uint64_t tail = atomic_load(&h->tail);
+  uint64_t end = head + cap / 8;
+  uint64_t skipped = 0;
+  while (tail + cap < end) {
+    lk_ring_record old;
+    memcpy(&old, data + (tail & (cap - 1)), sizeof(old));
+    tail += LK_RING_SIZE(old.len);
+    if (!(old.flags & LK_RING_PAD)) skipped++;
+  }
+  CHECK(skipped > 0);
+  atomic_store(&h->tail, tail);
+  atomic_store(&h->reserve, end);
+  // ... and the new bytes land over the record the reader is on
+  memset(data + (m.r.pos & (cap - 1)), 0xab, 64);
+
+  char line[64];
+  size_t len;
+  uint64_t lost = 0;
+  CHECK(lk_ring_next(&m.r, line, sizeof(line), &len, &lost));
+  CHECK(lost == skipped);
+  int num = -1;
+  CHECK(sscanf(line, "second %d", &num) == 1);
+  CHECK(m.r.next_seq == oldest_seq + skipped + 1);
+  uint64_t more_lost = 0;
+  int first = -1;
+  drain(&m, "second", &first, &more_lost);
+  CHECK(more_lost == 0);
+  munmap(m.map, m.len);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <logknife>\n", argv[0]);
+    return 2;
+  }
+  g_logknife = argv[1];
+  test_wrapped();
+  test_lapped();
+  test_torn();
+  if (failures) {
+    fprintf(stderr, "%d failure(s)\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}